@@ -3,6 +3,7 @@
  * 
  * <Name: Pradeep Kumar Vikraman, ID: pvikrama@andrew.cmu.edu>
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +15,22 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <limits.h>
+#include "tsh_serve.h"
+#include "tsh_shm.h"
+#include "tsh_lz4.h"
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
@@ -21,6 +38,87 @@
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
 
+/* Command lists */
+#define MAXNODES     64   /* max nodes in a command list tree */
+#define MAXLTOKS    128   /* max tokens in a command list */
+
+/* Glob expansion */
+#define XARENA    1<<16   /* bytes of storage for expanded arguments */
+#define MAXGSEG      32   /* max path components in a glob pattern */
+#define MAXGOPS     256   /* max compiled match ops per pattern */
+#define MAXGCLS      32   /* max [...] classes per pattern */
+#define DIRCACHE     64   /* cached directory listings */
+#define DENTBUF   1<<18   /* bytes fetched per getdents64 call */
+#define MAXGTHREADS  16   /* max threads walking a ** pattern */
+
+/* Command daemon */
+#define MAXCLIENTS   64   /* max clients connected to the daemon */
+#define REAPLOG      64   /* reaped children remembered for consumers */
+
+/* Admission control */
+#define PSI_INTERVAL 100  /* ms between pressure samples */
+
+/* DAG executor */
+#define MAXDAG      128   /* max nodes in a dag graph file */
+#define MAXDAGDEPS   16   /* max dependencies of a node */
+#define DAGNAME      32   /* max length of a node name */
+
+/* DAG node states */
+#define D_WAIT        0   /* waiting for its dependencies */
+#define D_RUN         1   /* running */
+#define D_OK          2   /* exited with status 0 */
+#define D_FAIL        3   /* failed to start or exited non-zero */
+#define D_SKIP        4   /* not run because a dependency failed */
+
+/* Redirections */
+#define MAXREDIRS    16   /* max redirections of a command */
+#define APPENDCACHE  16   /* files kept open for >> */
+#define APPENDTTL  1000   /* ms before a cached >> file is checked again */
+
+/* Redirection operators */
+#define R_IN          0   /* n< file */
+#define R_OUT         1   /* n> file */
+#define R_APPEND      2   /* n>> file */
+#define R_RDWR        3   /* n<> file */
+#define R_DUP         4   /* n>&m, n<&m */
+#define R_CLOSE       5   /* n>&-, n<&- */
+#define R_LOG         6   /* n> log:PREFIX */
+#define R_HEREDOC     7   /* n<<WORD, n<<-WORD */
+#define R_HERESTR     8   /* n<<< word */
+
+/* Here-documents */
+#define MAXDOCS      32   /* bodies kept for reuse */
+#define HEREPIPE  65536   /* largest body fed through a pipe */
+#define HEREMAX (16<<20)  /* max bytes of a body */
+
+/* Command substitution */
+#define MAXSUBST      4   /* max nesting of $(...) */
+#define SUBSTMAX  1<<20   /* max bytes of output of a substitution */
+
+/* Output capture */
+#define CAPSIZE   1<<16   /* default ring size of a captured job */
+
+/* Job logs */
+#define MAXLOGS      16   /* max job logs kept at a time */
+#define LOGSEGSIZE (64LL<<20) /* default bytes per log segment */
+#define LOGFLUSH   1000   /* ms a partial block may wait to be written */
+#define LOGPIPE   (1<<20) /* size asked for the pipe of a log */
+
+/* Scheduler */
+#define MAXSCHED     32   /* max every and at entries */
+#define SCHEDQUEUE    8   /* max runs an entry may have queued */
+#define SP_SKIP       0   /* a run due while the last one goes is skipped */
+#define SP_QUEUE      1   /* ... waits for it to finish */
+#define SP_ALLOW      2   /* ... is started anyway */
+
+/* Job timeouts */
+#define TICK_MS      10   /* resolution of the timer wheel (ms) */
+#define WHEEL_BITS    6   /* log2 of the slots per wheel level */
+#define WHEEL_SIZE   (1<<WHEEL_BITS)
+#define WHEEL_LEVELS  4   /* levels of the wheel */
+#define KILLGRACE  2000   /* default ms between SIGTERM and SIGKILL */
+#define DEADLINECHUNK 1024 /* deadlines allocated at a time */
+
 /* Job states */
 #define UNDEF         0   /* undefined */
 #define FG            1   /* running in foreground */
@@ -37,62 +135,378 @@
  * At most 1 job can be in the FG state.
  */
 
+/* Command list tokens */
+#define L_WORD        0   /* a simple command */
+#define L_SEMI        1   /* ; */
+#define L_AND         2   /* && */
+#define L_OR          3   /* || */
+#define L_LPAREN      4   /* ( */
+#define L_RPAREN      5   /* ) */
+#define L_BG          6   /* & */
+#define L_END         7   /* end of line */
+
+/* Command list nodes */
+#define N_CMD         0   /* a simple command */
+#define N_SEQ         1   /* left ; right */
+#define N_AND         2   /* left && right */
+#define N_OR          3   /* left || right */
+#define N_GROUP       4   /* ( left ) */
+
 /* Parsing states */
 #define ST_NORMAL   0x0   /* next token is an argument */
-#define ST_INFILE   0x1   /* next token is the input file */
-#define ST_OUTFILE  0x2   /* next token is the output file */
+#define ST_REDIR    0x1   /* next token is the target of a redirection */
 
 
 /* Global variables */
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+int cmdfd = STDIN_FILENO;   /* where command lines are read from */
 int nextjid = 1;			/* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 int state1;
 int bg,max;				/* should the job run in bg or fg? */
 pid_t foreground;
 int parsing_state;			/* indicates if the next token is the
-							   input or output file */
+							   target of a redirection */
+int glob_threads = 1;		/* threads used to walk ** patterns */
+char xarena[XARENA];		/* storage for expanded arguments */
+size_t xused;				/* bytes of xarena in use */
+
+struct deadline_t {         /* A job deadline in the timer wheel */
+	struct deadline_t *next;    /* next in its slot (or free list) */
+	struct deadline_t **pprev;  /* link that points to it */
+	long long expires;          /* tick at which it fires */
+	pid_t pid;                  /* job it belongs to */
+};
+struct deadline_t *wheel[WHEEL_LEVELS][WHEEL_SIZE]; /* The timer wheel */
+struct deadline_t *freedeadlines;   /* unused deadlines */
+long long wheel_now;        /* tick the wheel has reached */
+int wheel_count;            /* deadlines in the wheel */
+long bgtimeout;             /* default timeout of BG jobs (ms), 0 for none */
+long killgrace = KILLGRACE; /* ms between SIGTERM and SIGKILL */
+struct timeoutstats_t {     /* Jobs that ran out of time */
+	unsigned long timedout, killed;
+} timeoutstats;
 
 struct job_t {              /* The job struct */
 	pid_t pid;              /* job PID */
 	int jid;                /* job ID [1, 2, ...] */
 	int state;              /* UNDEF, BG, FG, or ST */
+	int owner;              /* daemon client that started it, or -1 */
+	int throttled;          /* stopped by admission control? */
+	struct deadline_t *deadline; /* its deadline, if any */
+	long timeout;           /* its time limit (ms) */
+	int timedout;           /* has the time limit passed? */
+	uint32_t tag;           /* tag of the request that started it */
+	long long started;      /* when it was started (ms) */
 	char cmdline[MAXLINE];  /* command line */
 };
 struct job_t job_list[MAXJOBS]; /* The job list */
+int fgexit;                 /* exit status of the last foreground job */
+int fgintr;                 /* was it killed by ctrl-c? */
+int listrunner;             /* are we the runner of a background list? */
+int tracefd = -1;           /* session trace being recorded, or -1 */
+long long tracelast;        /* time of the last trace record (ms) */
+struct tshshm_t *shm;       /* job registry, if there is one */
+const char *shmname;        /* its name */
+volatile sig_atomic_t shmbusy; /* is shmpub writing slots? */
+unsigned int shmdirty;      /* slots waiting to be written */
+
+struct ltoken_t {           /* A command list token */
+	int type;               /* L_WORD, L_SEMI, ... */
+	char *text;             /* the command of an L_WORD */
+};
+const char *ltokname[] = { "word", ";", "&&", "||", "(", ")", "&", "newline" };
+
+struct cmdnode_t {          /* A node of a command list tree */
+	int type;               /* N_CMD, N_SEQ, N_AND, N_OR or N_GROUP */
+	char *cmd;              /* the command of an N_CMD */
+	struct cmdnode_t *left, *right; /* operands (a group only has left) */
+};
+struct cmdnode_t nodes[MAXNODES]; /* The nodes of the current list */
+int nnodes;
+
+struct reap_t {             /* A child stopped or reaped by sigchld_handler */
+	pid_t pid;              /* its PID */
+	int jid;                /* its job ID */
+	int status;             /* its wait status */
+	int owner;              /* owner and tag of its job */
+	uint32_t tag;
+};
+struct reap_t reaplog[REAPLOG]; /* The last REAPLOG reaped children */
+volatile unsigned reapcount;    /* number of children ever logged */
+
+struct client_t {           /* A client of the command daemon */
+	int fd;                 /* its connection, -1 if the slot is free */
+};
+struct client_t clients[MAXCLIENTS];
+
+struct admit_t {            /* Admission control settings */
+	int inflight;           /* max running background jobs */
+	double cpu, mem, io;    /* max PSI some avg10 (%), 0 to ignore */
+	double load;            /* max 1 minute load average, 0 to ignore */
+	int delay;              /* ms a launch may wait before it is held back */
+	int stop;               /* stop running BG jobs under pressure? */
+} admitcfg = { MAXJOBS, 0, 0, 0, 0, 1000, 0 };
+
+struct pressure_t {         /* The last pressure sample */
+	double cpu, mem, io;    /* PSI some avg10 (%) */
+	double load;            /* 1 minute load average */
+	long long when;         /* when it was taken (ms) */
+} pressure;
+
+struct dagnode_t {          /* A node of a dag graph */
+	char name[DAGNAME];     /* its name */
+	char *cmd;              /* its command line */
+	int deps[MAXDAGDEPS];   /* indices of the nodes it depends on */
+	int ndeps;
+	int state;              /* D_WAIT, D_RUN, ... */
+	pid_t pid;              /* its job while it runs */
+	int exit;               /* its exit status */
+	long long start, end;   /* when it ran (ms) */
+	int held;               /* has admission control held it back? */
+};
+int dagactive;              /* is the dag builtin running? */
+volatile sig_atomic_t dagintr; /* was it interrupted with ctrl-c? */
+volatile sig_atomic_t dagtstp; /* was ctrl-z typed while it ran? */
+
+struct capture_t {          /* Captured output of a background job */
+	int jid;                /* job it belongs to */
+	pid_t pid;
+	int done;               /* has the job terminated? */
+	unsigned long seq;      /* order in which captures were attached */
+	int rfd;                /* read end of the job's pipe, -1 at EOF */
+	int memfd;              /* memfd backing the ring */
+	char *ring;             /* the ring, mapped from memfd */
+	size_t size;            /* ring size */
+	size_t head, len;       /* oldest byte and bytes held */
+	size_t total;           /* bytes captured in all */
+	char cmdline[MAXLINE];  /* command line of the job */
+} captures[MAXJOBS];
+struct capture_t *pending;  /* opened by capopen, not yet attached */
+int capture;                /* capture output of background jobs? */
+size_t capsize = CAPSIZE;   /* ring size for new captures */
+
+struct logblock_t {         /* Where a block of a job log is */
+	int seg;                /* segment it is in */
+	off_t off;              /* offset of its size word in the segment */
+	long long raw;          /* offset of its first byte in the output */
+	uint32_t rawlen, len;   /* bytes of output, bytes of block data */
+};
+struct joblog_t {           /* Output of a job being written to a log */
+	char *prefix;           /* PREFIX of > log:PREFIX, NULL if free */
+	int jid;                /* job it belongs to */
+	pid_t pid;
+	unsigned long seq;      /* order in which logs were opened */
+	int rfd;                /* read end of the job's pipe, -1 at EOF */
+	int segfd, idxfd;       /* segment being written and PREFIX.idx */
+	int seg, firstseg;      /* its number, and the oldest one kept */
+	off_t segoff;           /* bytes in it */
+	long long segstart;     /* when it was opened (ms) */
+	uint8_t *buf;           /* block being filled */
+	size_t buflen;
+	long long bufsince;     /* when its first byte came (ms) */
+	struct logblock_t *blocks; /* index of the blocks written */
+	int nblocks, maxblocks;
+	long long in, out;      /* bytes of output, bytes written to disk */
+	long long zns;          /* ns spent compressing */
+	long long start, end;   /* when it was opened and reached EOF (ms) */
+	int errors;             /* failed writes */
+	int busy;               /* claimed by logclaim? */
+} joblogs[MAXLOGS];
+struct logcfg_t {           /* Rotation of new segments */
+	long long size;         /* max bytes per segment */
+	long time;              /* max ms per segment, 0 for no limit */
+	int keep;               /* segments kept per log, 0 for all */
+} logcfg = { LOGSEGSIZE, 0, 0 };
+pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER; /* guards joblogs */
+pthread_cond_t logidle = PTHREAD_COND_INITIALIZER; /* a log was released */
+int logwake[2] = { -1, -1 }; /* pipe that wakes logthread */
+int logrunning;             /* has logthread been started? */
+
+struct schedent_t {         /* An every or at entry */
+	int id;                 /* its ID, 0 if the slot is free */
+	char cmd[MAXLINE];      /* command line it runs */
+	long long period;       /* us between runs, 0 for at */
+	long long due;          /* when it is next due (us) */
+	int policy;             /* SP_SKIP, SP_QUEUE or SP_ALLOW */
+	int slot;               /* its index in schedheap */
+	pid_t pid;              /* its last run */
+	int queued;             /* runs waiting for the last one to finish */
+	long long qdue[SCHEDQUEUE]; /* when each of them was due (a ring) */
+	int qhead;              /* the oldest of them in qdue */
+	unsigned long runs, skipped;
+	long long jsum, jmax, jn; /* jitter of its launches (us) */
+	struct heredoc_t *docs[MAXREDIRS]; /* bodies of its here-documents */
+	int ndocs;
+} schedents[MAXSCHED];
+struct schedent_t *schedheap[MAXSCHED]; /* min-heap of entries by due */
+int nsched;                 /* entries in the heap */
+pid_t schedpid;             /* the shell the entries belong to */
+int schedfds[3] = { -1, -1, -1 }; /* stdin, stdout and stderr of runs */
+timer_t schedtimer;         /* raises SIGALRM when an entry is due */
+struct schedstats_t {       /* Runs of all entries */
+	unsigned long launched, skipped, queued;
+	long long jsum, jmax, jn;
+} schedstats;
+
+struct heredoc_t {          /* A here-document or here-string body */
+	char *body;             /* NULL if the slot is free */
+	size_t len;
+	uint32_t hash;          /* FNV-1a of the body */
+	int memfd;              /* its sealed copy, -1 until one is needed */
+	int refs;               /* lines and every entries holding it */
+	unsigned long used;     /* heredocclock at its last use */
+} heredocs[MAXDOCS];
+unsigned long heredocclock;
+struct heredoc_t *linedocs[MAXREDIRS]; /* bodies of the current line */
+int nlinedocs;              /* bodies read for it */
+int nextdoc;                /* next one parseline hands out */
+struct heredocstats_t {     /* Use of the body cache */
+	unsigned long bodies, hits, piped, sealed, opened;
+} heredocstats;
+
+struct substbuf_t {         /* Output of a command substitution */
+	char *buf;
+	size_t len, cap;
+} substbufs[MAXSUBST];      /* one per nesting level */
+int substfds[MAXSUBST] = { -1, -1, -1, -1 }; /* memfds for builtins */
+int substdepth;             /* substitutions being expanded */
+
+struct appendent_t {        /* A file kept open for >> */
+	char *path;             /* as written on the command line, NULL if free */
+	int fd;                 /* O_APPEND|O_CLOEXEC descriptor */
+	dev_t dev;              /* identity of the file when opened */
+	ino_t ino;
+	long long used, checked; /* last use and last stat(2) (ms) */
+} appendcache[APPENDCACHE];
+struct appendstats_t {      /* Use of the >> cache */
+	unsigned long hits, opened, reopened;
+} appendstats;
+
+struct admitstats_t {       /* Admission decisions */
+	unsigned long admitted, delayed, held, stopped, resumed;
+} admitstats;
 
 struct cmdline_tokens {
 	int argc;               /* Number of arguments */
 	char *argv[MAXARGS];    /* The arguments list */
-	char *infile;           /* The input file */
-	char *outfile;          /* The output file */
+	int nredirs;            /* Number of redirections */
+	struct redir_t {        /* The redirections, in command line order */
+		int op;             /* R_IN, R_OUT, ... */
+		int fd;             /* descriptor being redirected */
+		int tofd;           /* descriptor copied by R_DUP, log of R_LOG,
+		                       body (in heredocs) of R_HEREDOC or R_HERESTR */
+		int cfd;            /* descriptor for R_APPEND, R_LOG or a body,
+		                       or -1 */
+		char *target;       /* file name (or descriptor, as written) */
+	} redirs[MAXREDIRS];
+	long timeout;           /* "timeout DURATION" prefix (ms), 0 if none */
 	enum builtins_t {       /* Indicates if argv[0] is a builtin command */
 		BUILTIN_NONE,
 		BUILTIN_QUIT,
 		BUILTIN_JOBS,
 		BUILTIN_BG,
-		BUILTIN_FG} builtins;
+		BUILTIN_FG,
+		BUILTIN_ADMIT,
+		BUILTIN_STATS,
+		BUILTIN_CAPTURE,
+		BUILTIN_TAIL,
+		BUILTIN_DUMP,
+		BUILTIN_TIMEOUT,
+		BUILTIN_DAG,
+		BUILTIN_ENABLE,
+		BUILTIN_LOGS,
+		BUILTIN_EVERY,
+		BUILTIN_AT,
+		BUILTIN_SCHED} builtins;
 };
 /* End global variables */
 
 
 /* Function prototypes */
-void eval(char *cmdline);
+int eval(char *cmdline);
+int runcmd(char *cmdline);
+struct cmdnode_t *parselist(const char *cmdline, int *bg);
+int runlist(struct cmdnode_t *n);
+int exitcode(int status);
+pid_t spawn(struct cmdline_tokens *tok, char *cmdline, int state, int *fds);
+int redirop(char *buf, struct cmdline_tokens *tok);
+const char *quoteend(const char *p, int q);
+const char *substend(const char *p);
+char *substword(char *word);
+int splitfields(char *s, struct cmdline_tokens *tok);
+int redirtarget(struct redir_t *r, char *word);
+int appendfd(const char *path);
+struct heredoc_t *heredocget(const char *s, size_t len, int nl);
+int heredocfd(struct heredoc_t *d);
+int heredocread(const char *cmdline, int prompt);
+int redirect(struct cmdline_tokens *tok, int *save);
+void unredirect(struct cmdline_tokens *tok, int *save);
+void serve(const char *path);
+long long now_ms(void);
+int admit(int maywait);
+void rebalance(void);
+void admitcmd(struct cmdline_tokens *tok);
+void printstats(void);
+int capopen(void);
+void capattach(pid_t pid, int wfd);
+void capdone(pid_t pid);
+void capcmd(struct cmdline_tokens *tok, int jidarg);
+void capturecmd(struct cmdline_tokens *tok);
+int logopen(const char *prefix, int *wfd);
+void logattach(int slot, pid_t pid, int wfd);
+struct joblog_t *findlog(int jid);
+void logwrite(struct joblog_t *l, int lines, int fd);
+void logscmd(struct cmdline_tokens *tok);
+void logsummary(void);
+void schedrun(void);
+int schedwait(void);
+int readcmd(char *cmdline);
+int schedcmd(struct cmdline_tokens *tok, const char *cmdline);
+int schedctl(struct cmdline_tokens *tok);
+int settimeout(pid_t pid, long ms);
+void untimeout(struct job_t *job);
+void wheel_reset(void);
+long parsetime(const char *s);
+void timeoutcmd(struct cmdline_tokens *tok);
+void traceopen(const char *path);
+void tracerec(char type, const char *text);
+void tracejobs(void);
+void shmopen(const char *name);
+void shmpub(struct job_t *job);
+int dagcmd(struct cmdline_tokens *tok);
+struct util_t *findutil(const char *name);
+int runutil(struct util_t *u, struct cmdline_tokens *tok);
+int echocmd(int argc, char **argv);
+int printfcmd(int argc, char **argv);
+int testcmd(int argc, char **argv);
+int truecmd(int argc, char **argv);
+int falsecmd(int argc, char **argv);
+int pwdcmd(int argc, char **argv);
+int sleepcmd(int argc, char **argv);
+int enablecmd(struct cmdline_tokens *tok);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void sigio_handler(int sig);
+void sigalrm_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, struct cmdline_tokens *tok); 
 void sigquit_handler(int sig);
+void logreap(pid_t pid, int status);
+char *xstrdup(const char *s, size_t len);
+int hasglob(const char *s);
+int globexpand(const char *pattern, struct cmdline_tokens *tok);
 void clearjob(struct job_t *job);
 void initjobs(struct job_t *job_list);
 int maxjid(struct job_t *job_list); 
 int addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline);
 int deletejob(struct job_t *job_list, pid_t pid); 
+int freejob(void);
 pid_t fgpid(struct job_t *job_list);
 struct job_t *getjobpid(struct job_t *job_list, pid_t pid);
 struct job_t *getjobjid(struct job_t *job_list, int jid); 
@@ -118,6 +532,24 @@ int Dup2(int fd1, int fd2);
 int Open(const char *pathname, int flags, mode_t mode);
 void Execve(const char *filename, char *const argv[], char *const envp[]);
 
+/* Utilities run in-process (see findutil) */
+struct util_t {
+	const char *name;
+	int (*fn)(int argc, char **argv);
+	int enabled;            /* not switched off with enable -n? */
+	int inshell;            /* may it run in the shell in the foreground? */
+} utils[] = {
+	{ "echo",   echocmd,   1, 1 },
+	{ "printf", printfcmd, 1, 1 },
+	{ "test",   testcmd,   1, 1 },
+	{ "[",      testcmd,   1, 1 },
+	{ "true",   truecmd,   1, 1 },
+	{ "false",  falsecmd,  1, 1 },
+	{ "pwd",    pwdcmd,    1, 1 },
+	{ "sleep",  sleepcmd,  1, 0 },
+	{ NULL,     NULL,      0, 0 }
+};
+
 /*
  * main - The shell's main routine 
  */
@@ -125,15 +557,25 @@ void Execve(const char *filename, char *const argv[], char *const envp[]);
 main(int argc, char **argv) 
 {
 	char c;
-	char cmdline[MAXLINE];    /* cmdline for fgets */
+	char cmdline[MAXLINE];    /* cmdline for readcmd */
 	int emit_prompt = 1; /* emit prompt (default) */
+	char *serve_path = NULL;  /* socket of the command daemon */
+	char *shm_name = NULL;    /* shared memory job registry */
+	int script = 0;           /* reading commands from a script? */
+	int status = 0;           /* of the last command line */
+	int i;
+	static struct option longopts[] = {
+		{"serve", required_argument, NULL, 's'},
+		{"shm", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0}
+	};
 
 	/* Redirect stderr to stdout (so that driver will get all output
 	 * on the pipe connected to stdout) */
 	dup2(1, 2);
 
 	/* Parse the command line */
-	while ((c = getopt(argc, argv, "hvp")) != EOF) {
+	while ((c = getopt_long(argc, argv, "hvpg:r:", longopts, NULL)) != EOF) {
 		switch (c) {
 			case 'h':             /* print help message */
 				usage();
@@ -144,15 +586,39 @@ main(int argc, char **argv)
 			case 'p':             /* don't print a prompt */
 				emit_prompt = 0;  /* handy for automatic testing */
 				break;
+			case 'g':             /* threads for walking ** globs */
+				glob_threads = atoi(optarg);
+				if (glob_threads < 1 || glob_threads > MAXGTHREADS)
+					usage();
+				break;
+			case 'r':             /* record the session for tshreplay */
+				traceopen(optarg);
+				break;
+			case 's':             /* run as a command daemon */
+				serve_path = optarg;
+				break;
+			case 'm':             /* mirror the jobs into shared memory */
+				shm_name = optarg;
+				break;
 			default:
 				usage();
 		}
 	}
+	if (optind < argc - 1)
+		usage();
+	if (optind == argc - 1) {     /* tsh [options] script */
+		if ((cmdfd = open(argv[optind], O_RDONLY|O_CLOEXEC)) < 0)
+			unix_error(argv[optind]);
+		script = 1;
+		emit_prompt = 0;
+	}
 
 	/* Install the signal handlers */
 	Signal(SIGINT,  sigint_handler);   /* ctrl-c */
 	Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
 	Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+	Signal(SIGIO,   sigio_handler);    /* Output of captured jobs */
+	Signal(SIGALRM, sigalrm_handler);  /* Tick of the timer wheel */
 	Signal(SIGTTIN, SIG_IGN);
 	Signal(SIGTTOU, SIG_IGN);
 
@@ -161,28 +627,49 @@ main(int argc, char **argv)
 
 	/* Initialize the job list */
 	initjobs(job_list);
+	for (i = 0; i < MAXJOBS; i++)
+		captures[i].rfd = captures[i].memfd = -1;
+	for (i = 0; i < MAXLOGS; i++)
+		joblogs[i].rfd = joblogs[i].segfd = joblogs[i].idxfd = -1;
+	if (shm_name)
+		shmopen(shm_name);
 
+	/* In daemon mode the shell serves clients instead of a terminal */
+	if (serve_path)
+		serve(serve_path);
 
 	/* Execute the shell's read/eval loop */
 	while (1) {
 
+		/* Stop or continue throttled jobs as the pressure changes */
+		rebalance();
+
 		if (emit_prompt) {
 			printf("%s", prompt);
 			fflush(stdout);
 		}
-		if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-			app_error("fgets error");
-		if (feof(stdin)) { 
-			/* End of file (ctrl-d) */
-			printf ("\n");
+		if (!readcmd(cmdline)) {
+			/* End of file (ctrl-d), or of the script, which exits with
+			 * the status of its last command line */
+			if (!script)
+				printf ("\n");
 			fflush(stdout);
 			fflush(stderr);
-			exit(0);
+			exit(script ? status : 0);
 		}
 		/* Remove the trailing newline */
 		cmdline[strlen(cmdline)-1] = '\0';
+		/* Lines of a script that start with # (#! too) are comments */
+		if (script && cmdline[strspn(cmdline, " \t")] == '#')
+			continue;
+		tracerec('c', cmdline);
+		/* The bodies of its here-documents follow the line */
+		if (heredocread(cmdline, emit_prompt) < 0) {
+			status = 1;
+			continue;
+		}
 		/* Evaluate the command line */
-		eval(cmdline);
+		status = eval(cmdline);
 		fflush(stdout);
 		fflush(stdout);
 	} 
@@ -191,15 +678,15 @@ main(int argc, char **argv)
 }
 
 /* 
- * eval - Evaluate the command line that the user has just typed in
+ * eval - Evaluate the command line that the user has just typed in and
+ *     return its exit status
  * 
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.  
+ * A line holding a single command is handed to runcmd.  A command list
+ * (commands joined by ;, && or || and grouped with parentheses) is
+ * parsed by parselist and run by runlist right here in the shell, each
+ * step chosen from the exit status of the one before, or, if the list
+ * ends with &, by a forked copy of the shell that is tracked as a
+ * single background job.
  */
 
 /* Functions and system calls written with their starting letter in capitals
@@ -207,23 +694,135 @@ main(int argc, char **argv)
  * wrapper functions where implemented with the help of csapp.c file.
  */
 
-	void 
+	int 
 eval(char *cmdline) 
+{
+	struct cmdnode_t *list;
+	sigset_t mask;
+	pid_t pid;
+	int bg, wfd;
+
+	if ((list = parselist(cmdline, &bg)) == NULL)
+		return 2;                       /* parsing error */
+	if (list->type == N_CMD)
+		/* A single command; parseline deals with a trailing & itself */
+		return runcmd(cmdline);
+	if (!bg)
+		return runlist(list);
+
+	/* A background list runs in a forked copy of the shell.  It stays in
+	 * the process group of its commands, so that stopping, continuing or
+	 * interrupting the job acts on the whole list.  Like any background
+	 * job it is admitted first, captured and given the default timeout.
+	 */
+	if (!admit(1))
+		return 1;
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigaddset(&mask, SIGINT);
+	Sigaddset(&mask, SIGTSTP);
+	Sigaddset(&mask, SIGIO);
+	Sigprocmask(SIG_BLOCK, &mask, NULL);
+	wfd = capopen();
+	fflush(stdout);
+	if ((pid = Fork()) == 0) {
+		if (wfd >= 0) {
+			dup2(wfd, STDOUT_FILENO);
+			dup2(wfd, STDERR_FILENO);
+			close(wfd);
+		}
+		Setpgid(0, 0);
+		Signal(SIGCHLD, SIG_DFL);
+		Signal(SIGINT, SIG_DFL);
+		Signal(SIGTSTP, SIG_DFL);
+		Signal(SIGIO, SIG_IGN);
+		Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		initjobs(job_list);
+		wheel_reset();
+		listrunner = 1;
+		exit(runlist(list));
+	}
+	addjob(job_list, pid, BG, cmdline);
+	capattach(pid, wfd);
+	if (bgtimeout)
+		settimeout(pid, bgtimeout);
+	Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	printf("[%d] (%d) %s\n", pid2jid(pid), pid, cmdline);
+	return 0;
+}
+
+/* 
+ * runcmd - Run a single command line and return its exit status
+ * 
+ * If the user has requested a built-in command (quit, jobs, bg or fg)
+ * then execute it immediately. Otherwise, fork a child process and
+ * run the job in the context of the child. If the job is running in
+ * the foreground, wait for it to terminate and then return.  Note:
+ * each child process must have a unique process group ID so that our
+ * background children don't receive SIGINT (SIGTSTP) from the kernel
+ * when we type ctrl-c (ctrl-z) at the keyboard.  
+ */
+	int 
+runcmd(char *cmdline) 
 {
 	struct cmdline_tokens tok;
 	pid_t pid;
 	sigset_t mask,masksuspend;
 	char *ptr;
-	int id,fd1,fd2,fd3,fdtemp;
+	int id,status=0,sched;
+	int capfds[3] = { -1, -1, -1 };
+	int save[MAXREDIRS];
 	struct job_t *fg,*bg1;
+	struct util_t *util=NULL;
+
+	/* Delete only SIGCHLD, SIGINT, SIGTSTP, SIGIO and SIGALRM from
+	 * sigsuspend's mask so as to ensure that it waits for only these signals
+	 * (SIGIO keeps captured background output flowing and SIGALRM turns the
+	 * timer wheel while we wait)
+	 */
+	Sigfillset(&masksuspend);
+	Sigdelset(&masksuspend, SIGCHLD);
+	Sigdelset(&masksuspend, SIGINT);
+	Sigdelset(&masksuspend, SIGTSTP);
+	Sigdelset(&masksuspend, SIGIO);
+	Sigdelset(&masksuspend, SIGALRM);
 
 	/* Parse command line */
 	bg = parseline(cmdline, &tok);
+	if (bg == -1) return 2;             /* parsing error */
+	if (tok.argv[0] == NULL)  return 0; /* ignore empty lines */
 	if(bg)
 		state1=BG;
 	else
 		state1=FG;
 
+	/* Only a process can write to a log, see logopen */
+	for(id=0;id<tok.nredirs;id++)
+		if(tok.redirs[id].op==R_LOG)
+			break;
+	sched=tok.builtins == BUILTIN_EVERY || tok.builtins == BUILTIN_AT;
+	if(id<tok.nredirs && tok.builtins != BUILTIN_NONE && !sched)
+	{
+		printf("%s: log redirections are for commands only\n",tok.argv[0]);
+		return 1;
+	}
+
+	/* A simple utility runs in the shell unless it has to be a job */
+	if(tok.builtins == BUILTIN_NONE && !bg && !tok.timeout &&
+			id==tok.nredirs)
+		if((util=findutil(tok.argv[0]))!=NULL && !util->inshell)
+			util=NULL;
+
+	/* Built-ins run in the shell itself, with their redirections applied
+	 * to the shell's own descriptors until they are done
+	 */
+	if((tok.builtins != BUILTIN_NONE || util) && tok.nredirs > 0 && !sched)
+	{
+		fflush(stdout);
+		if(redirect(&tok,save)<0)
+			return 1;
+	}
+
 	/* fg built-in command */
 	if((tok.builtins)== BUILTIN_FG)
 	{
@@ -244,17 +843,27 @@ eval(char *cmdline)
 			if(fg->state==ST)
 			{	
 				fg->state=FG;
+				fg->throttled=0;
+				shmpub(fg);
 				Kill(-(fg->pid),SIGCONT);
 				while(fgpid(job_list))
+				{
 					sigsuspend(&masksuspend);
-				return;
+					schedrun();
+				}
+				status=fgexit;
 			}
 			else
+			{
 				printf("There is no stopped process right now\n");
-			return;
+				status=1;
+			}
 		}
 		else
+		{
 			printf("%s: No such job\n",tok.argv[1]);
+			status=1;
+		}
 	}
 
 	/* bg built-in command */
@@ -274,281 +883,5655 @@ eval(char *cmdline)
 			if(bg1->state==ST)
 			{
 				bg1->state=BG;
+				bg1->throttled=0;
+				shmpub(bg1);
 				printf("[%d] (%d) %s\n",bg1->jid,bg1->pid,bg1->cmdline);
 				Kill(-(bg1->pid),SIGCONT);
-				return;
 			}
 			else
+			{
 				printf("There is no stopped process right now\n");
-			return;
+				status=1;
+			}
 		}
 		else
+		{
 			printf("%s: No such job\n",tok.argv[1]);
+			status=1;
+		}
+	}
+
+	/* quit built-in command */
+
+	if(tok.builtins == BUILTIN_QUIT)
+		/* Exit the shell if you get a quit command */
+		exit(0);
+
+	/* capture built-in command */
+	if(tok.builtins == BUILTIN_CAPTURE)
+		capturecmd(&tok);
+
+	/* tail and dump built-in commands, and jobs -o %N */
+	if(tok.builtins == BUILTIN_TAIL || tok.builtins == BUILTIN_DUMP)
+		capcmd(&tok,1);
+	else if(tok.builtins == BUILTIN_JOBS && tok.argc > 1 &&
+			!strcmp(tok.argv[1],"-o"))
+		capcmd(&tok,2);
+
+	/* jobs built-in command (any redirection is already in place) */
+	else if((tok.builtins)== BUILTIN_JOBS)
+	{
+		listjobs(job_list,STDOUT_FILENO);
+		if(tracefd>=0)
+			tracejobs();
+	}
+
+	/* admit built-in command */
+	if(tok.builtins == BUILTIN_ADMIT)
+		admitcmd(&tok);
+
+	/* timeout built-in command */
+	if(tok.builtins == BUILTIN_TIMEOUT)
+		timeoutcmd(&tok);
+
+	/* dag built-in command */
+	if(tok.builtins == BUILTIN_DAG)
+		status=dagcmd(&tok);
+
+	/* stats built-in command */
+	if(tok.builtins == BUILTIN_STATS)
+		printstats();
+
+	/* enable built-in command */
+	if(tok.builtins == BUILTIN_ENABLE)
+		status=enablecmd(&tok);
+
+	/* logs built-in command */
+	if(tok.builtins == BUILTIN_LOGS)
+		logscmd(&tok);
+
+	/* every, at and sched built-in commands (the redirections of every
+	 * and at belong to the command they schedule) */
+	if(tok.builtins == BUILTIN_EVERY || tok.builtins == BUILTIN_AT)
+		return schedcmd(&tok,cmdline);
+	if(tok.builtins == BUILTIN_SCHED)
+		status=schedctl(&tok);
+
+	/* echo, test, true and the like */
+	if(util)
+		status=runutil(util,&tok);
+
+	if(tok.builtins== BUILTIN_NONE && !util)
+	{
+		/* Background launches have to pass admission control first */
+		if(bg && !admit(1))
+			return 1;
+
+		/* Now for the sigprocmask fill in only SIGCHLD, SIGINT, SIGTSTP and
+		 * SIGIO so as to ensure that these signals do not interrupt the
+		 * parent until a job is added by blocking them till then , because
+		 * otherwise these lead to race conditions
+		 */
+		Sigemptyset(&mask);
+		Sigaddset(&mask, SIGCHLD);
+		Sigaddset(&mask, SIGINT);
+		Sigaddset(&mask, SIGTSTP);
+		Sigaddset(&mask, SIGIO);
+		Sigprocmask(SIG_BLOCK,&mask,NULL);
+
+		/* Captured background jobs write to a pipe the shell drains */
+		if(bg && (capfds[1]=capfds[2]=capopen())>=0)
+		{
+			pid=spawn(&tok,cmdline,state1,capfds);
+			capattach(pid,capfds[1]);
+		}
+		else
+			pid=spawn(&tok,cmdline,state1,NULL);
+
+		/* Start the clock of jobs with a time limit */
+		if(tok.timeout || (bg && bgtimeout))
+			settimeout(pid,tok.timeout ? tok.timeout : bgtimeout);
+		/* As seen below unblocking the signals is done only after addjob */
+
+		/* If the bg flag is not set, i.e. if its a foreground job wait for
+		 * it to execute using sigsuspend on the parent and making the parent 
+		 * wait until it gets a SIGCHLD when the foreground job terminates or it
+		 * gets a SIGINT or SIGTSTP signal
+		 */
+		if(listrunner)
+		{
+			/* Inside a background list: the command shares our process
+			 * group and is waited for directly */
+			Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+			while(waitpid(pid,&status,0)<0 && errno==EINTR)
+				;
+			untimeout(getjobpid(job_list,pid));
+			deletejob(job_list,pid);
+			return exitcode(status);
+		}
+		else if(!bg)
+		{
+			while(fgpid(job_list))
+			{
+				sigsuspend(&masksuspend);
+				schedrun();
+			}
+			Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+			return fgexit;
+		}
+
+		/* If its a backgroud process print the details of the job and wait for
+		 * the users next command line input
+		 */
+		else
+		{
+			Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+			printf("[%d] (%d) %s\n",pid2jid(pid),pid,cmdline);
+		}
+
+		return 0;
+	}
+
+	if(tok.nredirs > 0)
+		unredirect(&tok,save);
+	return status;
+}
+/*
+ * spawn - Fork a child that runs the command in tok and add it to the job
+ *     list in the given state.  If fds is not NULL, fds[0..2] (where not
+ *     -1) become the child's stdin, stdout and stderr before the
+ *     redirections in tok are applied.  Files appended to with >> are
+ *     taken from the shell's cache of open descriptors, and logs and
+ *     here-documents are opened here, so that a log that cannot be
+ *     written is reported by the shell and the memfd of a large body is
+ *     sealed once for all the commands that read it.  The caller must
+ *     block SIGCHLD, SIGINT and SIGTSTP so that the job is added before
+ *     it can be reaped.
+ */
+	pid_t 
+spawn(struct cmdline_tokens *tok, char *cmdline, int state, int *fds)
+{
+	pid_t pid;
+	sigset_t mask;
+	struct util_t *u;
+	int i;
+
+	for(i=0;i<tok->nredirs;i++)
+		if(tok->redirs[i].op==R_APPEND)
+			tok->redirs[i].cfd=appendfd(tok->redirs[i].target);
+		else if(tok->redirs[i].op==R_LOG)
+			tok->redirs[i].tofd=logopen(tok->redirs[i].target,
+					&tok->redirs[i].cfd);
+		else if(tok->redirs[i].op==R_HEREDOC||tok->redirs[i].op==R_HERESTR)
+			tok->redirs[i].cfd=heredocfd(&heredocs[tok->redirs[i].tofd]);
+
+	/* A child that runs a utility flushes stdout when it is done, so
+	 * it must not inherit anything the shell has yet to write */
+	fflush(stdout);
+	if((pid=Fork())==0)
+	{
+		/* Set the group ID of the child to be equal to its PID and put it
+		 * in a different group than the parent tsh shell, so as to 
+		 * ensure that if it gets a sigint or sigtstp signal only the child 
+		 * is terminated or stopped and not the parent tsh shell.  (Commands
+		 * of a background list stay in the group of the list's job.)
+		 */
+		if(!listrunner)
+			Setpgid(0,0);
+
+		/* Unblock SIGCHLD, SIGINT and SIGTSTP in the child */
+		Sigemptyset(&mask);
+		Sigaddset(&mask, SIGCHLD);
+		Sigaddset(&mask, SIGINT);
+		Sigaddset(&mask, SIGTSTP);
+		Sigprocmask(SIG_UNBLOCK, &mask,NULL);
+
+		/* Descriptors handed over by a daemon client come first */
+		for(i=0;fds && i<3;i++)
+			if(fds[i]>=0)
+				Dup2(fds[i],i);
+
+		/* Then the redirections, left to right */
+		redirect(tok,NULL);
+
+		/* A simple utility needs no exec, just the signal dispositions
+		 * an exec would have given it */
+		if((u=findutil(tok->argv[0]))!=NULL)
+		{
+			Signal(SIGINT,SIG_DFL);
+			Signal(SIGTSTP,SIG_DFL);
+			Signal(SIGCHLD,SIG_DFL);
+			Signal(SIGIO,SIG_DFL);
+			Signal(SIGALRM,SIG_DFL);
+			Signal(SIGQUIT,SIG_DFL);
+			i=u->fn(tok->argc,tok->argv);
+			fflush(stdout);
+			_exit(i);
+		}
+
+		Execve(tok->argv[0],tok->argv,environ);
 	}
+	addjob(job_list,pid,state,cmdline);
+	for(i=0;i<tok->nredirs;i++)
+		if(tok->redirs[i].op==R_LOG)
+			logattach(tok->redirs[i].tofd,pid,tok->redirs[i].cfd);
+		else if((tok->redirs[i].op==R_HEREDOC||tok->redirs[i].op==R_HERESTR)
+				&&tok->redirs[i].cfd>=0)
+		{
+			close(tok->redirs[i].cfd);
+			tok->redirs[i].cfd=-1;
+		}
+	return pid;
+}
+
+/* 
+ * parseline - Parse the command line and build the argv array.
+ * 
+ * Parameters:
+ *   cmdline:  The command line, in the form:
+ *
+ *                command [arguments...] [redirections...] [&]
+ *
+ *             Unquoted arguments containing *, ?, [...] or ** are
+ *             replaced by the paths they match (see globexpand).
+ *             $(command) outside single quotes is replaced by the output
+ *             of command (see substword).
+ *             (Command lists are split into such commands by parselist.)
+ *             Redirections (see redirect) may appear anywhere among the
+ *             arguments and are collected in order in tok->redirs.
+ *
+ *   tok:      Pointer to a cmdline_tokens structure. The elements of this
+ *             structure will be populated with the parsed tokens. Characters 
+ *             enclosed in single or double quotes are treated as a single
+ *             argument. 
+ * Returns:
+ *   1:        if the user has requested a BG job
+ *   0:        if the user has requested a FG job  
+ *  -1:        if cmdline is incorrectly formatted
+ * 
+ * Note:       The string elements of tok (e.g., argv[], redirection targets) 
+ *             are statically allocated inside parseline() (or in xarena)
+ *             and will be overwritten the next time this function is
+ *             invoked.
+ */
+	int 
+parseline(const char *cmdline, struct cmdline_tokens *tok) 
+{
+
+	static char array[MAXSUBST + 1][MAXLINE]; /* local copies of command lines,
+											one per substitution level */
+	const char delims[10] = " \t\r\n";   /* argument delimiters (white-space) */
+	char *buf = array[substdepth];       /* ptr that traverses command line */
+	char *next;                          /* ptr to the end of the current arg */
+	char *endbuf;                        /* ptr to the end of the 
+											cmdline string */
+	int is_bg;                           /* background job? */
+	int quoted;                          /* was the token quoted? */
+	int split;                           /* split the token into fields? */
+	int literal = 0;                     /* was the last argument typed in? */
+	int n;                               /* length of a redirection operator */
+
+	if (cmdline == NULL) {
+		(void) fprintf(stderr, "Error: command line is NULL\n");
+		return -1;
+	}
+
+	(void) strncpy(buf, cmdline, MAXLINE);
+	endbuf = buf + strlen(buf);
+
+	tok->nredirs = 0;
+	if (substdepth == 0)                 /* not inside a $(...) */
+		xused = 0;
+
+	/* Build the argv list */
+	parsing_state = ST_NORMAL;
+	tok->argc = 0;
+
+	while (buf < endbuf) {
+		/* Skip the white-spaces */
+		buf += strspn (buf, delims);
+		if (buf >= endbuf) break;
+		/* Check for I/O redirection operators */
+		if ((n = redirop(buf, tok)) != 0) {
+			if (n < 0)
+				return -1;
+			if (parsing_state != ST_NORMAL)
+				break;
+			parsing_state = ST_REDIR;
+			buf += n;
+			continue;
+		}
+
+		if ((quoted = (*buf == '\'' || *buf == '\"'))) {
+			/* Detect quoted tokens */
+			buf++;
+			next = (char *) quoteend (buf, *(buf-1));
+		} else {
+			/* Find next delimiter, passing over $(...) */
+			for (next = buf; *next != '\0' && !strchr(delims, *next); next++)
+				if (next[0] == '$' && next[1] == '(' &&
+						(next = (char *) substend(next + 2)) == NULL) {
+					(void) fprintf (stderr, "Error: unmatched $(.\n");
+					return -1;
+				}
+		}
+
+		if (next == NULL) {
+			/* Returned by strchr(); this means that the closing
+			   quote was not found. */
+			(void) fprintf (stderr, "Error: unmatched %c.\n", *(buf-1));
+			return -1;
+		}
+
+		/* Terminate the token */
+		*next = '\0';
+
+		/* Replace $(command) by its output */
+		split = 0;
+		if ((!quoted || *(buf-1) == '"') && strstr(buf, "$(") != NULL) {
+			if ((buf = substword(buf)) == NULL)
+				return -1;
+			split = !quoted;
+		}
+
+		/* Record the token as either the next argument or the 
+		 * input/output file */
+		switch (parsing_state) {
+			case ST_NORMAL:
+				/* Unquoted words with wildcards are replaced by the
+				 * sorted list of paths they match */
+				literal = !split;
+				if (split) {
+					if (splitfields(buf, tok) < 0)
+						return -1;
+				} else if (!quoted && hasglob(buf)) {
+					if (globexpand(buf, tok) < 0)
+						return -1;
+				} else
+					tok->argv[tok->argc++] = buf;
+				break;
+			case ST_REDIR:
+				if (redirtarget(&tok->redirs[tok->nredirs - 1], buf) < 0)
+					return -1;
+				break;
+		}
+		parsing_state = ST_NORMAL;
+
+		/* Check if argv is full */
+		if (tok->argc >= MAXARGS-1) break;
+
+		buf = next + 1;
+	}
+
+	if (parsing_state != ST_NORMAL) {
+		(void)fprintf(stderr,"Error: must provide file name for redirection\n");
+		return -1;
+	}
+
+	/* The argument list must end with a NULL pointer */
+	tok->argv[tok->argc] = NULL;
+
+	if (tok->argc == 0)  /* ignore blank line */
+		return 1;
+
+	/* A "timeout DURATION" prefix limits how long the command may run */
+	tok->timeout = 0;
+	if (!strcmp(tok->argv[0], "timeout") && tok->argc > 2 &&
+			*tok->argv[1] != '-') {
+		if ((tok->timeout = parsetime(tok->argv[1])) <= 0) {
+			(void) fprintf(stderr, "Error: invalid timeout %s\n", tok->argv[1]);
+			return -1;
+		}
+		memmove(tok->argv, tok->argv + 2, (tok->argc - 1) * sizeof(char *));
+		tok->argc -= 2;
+	}
+
+	if (!strcmp(tok->argv[0], "quit")) {                 /* quit command */
+		tok->builtins = BUILTIN_QUIT;
+	} else if (!strcmp(tok->argv[0], "jobs")) {          /* jobs command */
+		tok->builtins = BUILTIN_JOBS;
+	} else if (!strcmp(tok->argv[0], "bg")) {            /* bg command */
+		tok->builtins = BUILTIN_BG;
+	} else if (!strcmp(tok->argv[0], "fg")) {            /* fg command */
+		tok->builtins = BUILTIN_FG;
+	} else if (!strcmp(tok->argv[0], "admit")) {         /* admit command */
+		tok->builtins = BUILTIN_ADMIT;
+	} else if (!strcmp(tok->argv[0], "stats")) {         /* stats command */
+		tok->builtins = BUILTIN_STATS;
+	} else if (!strcmp(tok->argv[0], "capture")) {       /* capture command */
+		tok->builtins = BUILTIN_CAPTURE;
+	} else if (!strcmp(tok->argv[0], "tail")) {          /* tail command */
+		tok->builtins = BUILTIN_TAIL;
+	} else if (!strcmp(tok->argv[0], "dump")) {          /* dump command */
+		tok->builtins = BUILTIN_DUMP;
+	} else if (!strcmp(tok->argv[0], "timeout")) {       /* timeout command */
+		tok->builtins = BUILTIN_TIMEOUT;
+	} else if (!strcmp(tok->argv[0], "dag")) {           /* dag command */
+		tok->builtins = BUILTIN_DAG;
+	} else if (!strcmp(tok->argv[0], "enable")) {        /* enable command */
+		tok->builtins = BUILTIN_ENABLE;
+	} else if (!strcmp(tok->argv[0], "logs")) {          /* logs command */
+		tok->builtins = BUILTIN_LOGS;
+	} else if (!strcmp(tok->argv[0], "every")) {         /* every command */
+		tok->builtins = BUILTIN_EVERY;
+	} else if (!strcmp(tok->argv[0], "at")) {            /* at command */
+		tok->builtins = BUILTIN_AT;
+	} else if (!strcmp(tok->argv[0], "sched")) {         /* sched command */
+		tok->builtins = BUILTIN_SCHED;
+	} else {
+		tok->builtins = BUILTIN_NONE;
+	}
+
+	/* Should the job run in the background?  (Not if the & came out
+	 * of a substitution.) */
+	if ((is_bg = (literal && *tok->argv[tok->argc-1] == '&')) != 0)
+		tok->argv[--tok->argc] = NULL;
+
+	return is_bg;
+}
+
+
+/*****************
+ * Redirections
+ *****************/
+
+/*
+ * parseline collects the redirections of a command in order, as
+ *
+ *     [n]< file    [n]> file    [n]>| file    [n]>> file    [n]<> file
+ *     [n]>&m       [n]<&m       [n]>&-        [n]<&-
+ *     [n]<<WORD    [n]<<-WORD   [n]<<< word
+ *
+ * (n defaults to 0 for <, <>, << and <<<, to 1 otherwise) and redirect applies
+ * them left to right, so ">out 2>&1" sends both streams to out while
+ * "2>&1 >out" leaves stderr where stdout was.
+ *
+ * Files opened for >> are kept open by the shell in a small cache of
+ * O_APPEND|O_CLOEXEC descriptors, so that a log appended to by every
+ * command of a loop costs one open(2) rather than one per launch.  The
+ * child just dup2()s the cached descriptor.  A cached entry is checked
+ * against the path again (stat(2), same device and inode) when it is
+ * used more than APPENDTTL ms after the last check, so a log that has
+ * been rotated or removed is reopened.  Relative paths are cached as
+ * written; that is safe because the shell never changes directory.
+ *
+ * A target of the form log:PREFIX (after >, >| or >>) makes the stream
+ * a compressed, rotated job log instead of a file; see "Job logs".
+ * << and <<< are described in "Here-documents".
+ */
+
+/* redirtarget - Fill in the target of r from word, -1 if it is invalid */
+	int 
+redirtarget(struct redir_t *r, char *word)
+{
+	struct heredoc_t *d;
+	char *end;
+
+	r->target = word;
+	if (r->op == R_HEREDOC) {
+		if (nextdoc >= nlinedocs) {
+			(void) fprintf(stderr, "Error: here-document without a body\n");
+			return -1;
+		}
+		r->tofd = linedocs[nextdoc++] - heredocs;
+		return 0;
+	}
+	if (r->op == R_HERESTR) {
+		if ((d = heredocget(word, strlen(word), 1)) == NULL)
+			return -1;
+		r->tofd = d - heredocs;
+		return 0;
+	}
+	if ((r->op == R_OUT || r->op == R_APPEND) && !strncmp(word, "log:", 4)) {
+		if (word[4] == '\0') {
+			(void) fprintf(stderr, "Error: log: needs a prefix\n");
+			return -1;
+		}
+		r->op = R_LOG;
+		r->target = word + 4;
+		return 0;
+	}
+	if (r->op != R_DUP)
+		return 0;
+	if (!strcmp(word, "-")) {
+		r->op = R_CLOSE;
+		return 0;
+	}
+	r->tofd = strtol(word, &end, 10);
+	if (end == word || *end != '\0' || r->tofd < 0) {
+		(void) fprintf(stderr, "Error: %s: bad file descriptor\n", word);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * redirop - If buf starts with a redirection operator, add it to tok and
+ *     return its length, else return 0
+ */
+	int 
+redirop(char *buf, struct cmdline_tokens *tok)
+{
+	struct redir_t *r;
+	char *p = buf;
+	long fd = -1;
+
+	if (isdigit((unsigned char) *p))
+		fd = strtol(p, &p, 10);
+	if (*p != '<' && *p != '>')
+		return 0;
+	if (tok->nredirs == MAXREDIRS) {
+		(void) fprintf(stderr, "Error: too many redirections\n");
+		return -1;
+	}
+	r = &tok->redirs[tok->nredirs];
+	r->cfd = -1;
+	if (*p == '<') {
+		r->fd = 0;
+		if (p[1] == '>')
+			r->op = R_RDWR, p++;
+		else if (p[1] == '&')
+			r->op = R_DUP, p++;
+		else if (p[1] == '<' && p[2] == '<')
+			r->op = R_HERESTR, p += 2;
+		else if (p[1] == '<') {
+			r->op = R_HEREDOC, p++;
+			if (p[1] == '-')     /* the tabs went with the body */
+				p++;
+		} else
+			r->op = R_IN;
+	} else {
+		r->fd = 1;
+		if (p[1] == '>')
+			r->op = R_APPEND, p++;
+		else if (p[1] == '&')
+			r->op = R_DUP, p++;
+		else {
+			r->op = R_OUT;
+			if (p[1] == '|')
+				p++;
+		}
+	}
+	if (fd >= 0)
+		r->fd = fd;
+	tok->nredirs++;
+	return p + 1 - buf;
+}
+
+/*
+ * appendfd - Descriptor of path opened for appending, from the cache.
+ *     Returns -1 (with errno set) if the file cannot be opened.
+ */
+	int 
+appendfd(const char *path)
+{
+	struct appendent_t *e, *victim = &appendcache[0];
+	struct stat st;
+	long long now = now_ms();
+	int i, fd;
+
+	for (i = 0; i < APPENDCACHE; i++) {
+		e = &appendcache[i];
+		if (e->path == NULL || strcmp(e->path, path)) {
+			if (e->path == NULL || (victim->path != NULL && e->used < victim->used))
+				victim = e;
+			continue;
+		}
+		e->used = now;
+		if (now - e->checked < APPENDTTL) {
+			appendstats.hits++;
+			return e->fd;
+		}
+		e->checked = now;
+		if (stat(path, &st) == 0 && st.st_dev == e->dev && st.st_ino == e->ino) {
+			appendstats.hits++;
+			return e->fd;
+		}
+		/* Rotated or removed since it was opened */
+		appendstats.reopened++;
+		victim = e;
+		break;
+	}
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666)) < 0)
+		return -1;
+	appendstats.opened++;
+	if (victim->path != NULL) {
+		close(victim->fd);
+		free(victim->path);
+	}
+	if (fstat(fd, &st) < 0 || (victim->path = strdup(path)) == NULL) {
+		/* Let the caller open it the ordinary way */
+		victim->path = NULL;
+		close(fd);
+		return -1;
+	}
+	victim->fd = fd;
+	victim->dev = st.st_dev;
+	victim->ino = st.st_ino;
+	victim->used = victim->checked = now;
+	return fd;
+}
+
+/*
+ * redirect - Apply the redirections of tok to the calling process.
+ *
+ * In a child (save == NULL) a failure ends the process.  The shell
+ * itself applies a builtin's redirections with save pointing to
+ * MAXREDIRS slots that keep what was replaced, for unredirect; on a
+ * failure it undoes what was done and returns -1.
+ */
+	int 
+redirect(struct cmdline_tokens *tok, int *save)
+{
+	struct redir_t *r;
+	int i, fd;
+
+	for (i = 0; i < tok->nredirs; i++) {
+		r = &tok->redirs[i];
+		if (save != NULL) {
+			/* Keep the descriptor we are about to replace, well clear
+			 * of the ones commands use */
+			save[i] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+			if (r->op == R_APPEND)
+				r->cfd = appendfd(r->target);
+		}
+		switch (r->op) {
+			case R_IN:
+				fd = open(r->target, O_RDONLY);
+				break;
+			case R_OUT:
+				fd = open(r->target, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+				break;
+			case R_APPEND:
+				fd = r->cfd >= 0 ? r->cfd :
+					open(r->target, O_WRONLY|O_CREAT|O_APPEND, 0666);
+				break;
+			case R_RDWR:
+				fd = open(r->target, O_RDWR|O_CREAT, 0666);
+				break;
+			case R_DUP:
+				fd = r->tofd;
+				break;
+			case R_LOG:          /* the log's pipe, opened by spawn */
+				if ((fd = r->cfd) < 0 && save == NULL)
+					_exit(1);    /* logopen has said why */
+				break;
+			case R_HEREDOC:
+			case R_HERESTR:      /* spawn may have opened it already */
+				fd = r->cfd >= 0 ? r->cfd : heredocfd(&heredocs[r->tofd]);
+				break;
+			default:             /* R_CLOSE */
+				close(r->fd);
+				continue;
+		}
+		if (fd < 0 || dup2(fd, r->fd) < 0) {
+			fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+			if (save == NULL)
+				_exit(1);
+			tok->nredirs = i + 1;
+			unredirect(tok, save);
+			return -1;
+		}
+		if (fd != r->fd && fd != r->cfd && r->op != R_DUP)
+			close(fd);
+	}
+	return 0;
+}
+
+/* unredirect - Put back the descriptors a builtin's redirect replaced */
+	void 
+unredirect(struct cmdline_tokens *tok, int *save)
+{
+	int i;
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = tok->nredirs - 1; i >= 0; i--) {
+		if (save[i] >= 0) {
+			dup2(save[i], tok->redirs[i].fd);
+			close(save[i]);
+		} else
+			close(tok->redirs[i].fd);
+	}
+}
+
+/*****************
+ * Here-documents
+ *****************/
+
+/*
+ * "command <<WORD" takes its stdin from the lines that follow the
+ * command line, up to a line that is just WORD ("<<-WORD" strips leading
+ * tabs from them), and "command <<< word" from word and a newline.
+ * Bodies are taken literally: nothing in them is expanded.
+ *
+ * The main loop reads the bodies of a line (heredocread) before it runs
+ * the line, and parseline hands them out to the <<s of the line in the
+ * order they appear.  Bodies are kept in a small cache keyed by their
+ * contents, so that a body that comes again (the same here-document in
+ * every turn of a script, or an every entry's, which keeps its bodies)
+ * is neither copied nor set up again.
+ *
+ * A body of up to HEREPIPE bytes is written into a pipe, which always
+ * has room for it, and the read end becomes the command's stdin.  A
+ * larger body is written once into a memfd that is then sealed against
+ * any change; each command gets a descriptor of its own (with its own
+ * offset) by opening /proc/self/fd/N again.  Nothing touches the disk.
+ */
+
+/* heredochash - FNV-1a of a body */
+	static uint32_t 
+heredochash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+/*
+ * heredocget - The cached body s (len bytes, and a newline if nl), added
+ *     to the cache if it is not there.  NULL if the cache is full of
+ *     bodies in use.
+ */
+	struct heredoc_t *
+heredocget(const char *s, size_t len, int nl)
+{
+	struct heredoc_t *d, *victim = NULL;
+	uint32_t h = heredochash(s, len);
+	int i;
+
+	if (nl)
+		h = (h ^ '\n') * 16777619u;
+	for (i = 0; i < MAXDOCS; i++) {
+		d = &heredocs[i];
+		if (d->body != NULL && d->hash == h && d->len == len + nl &&
+				!memcmp(d->body, s, len)) {
+			heredocstats.hits++;
+			d->used = ++heredocclock;
+			return d;
+		}
+		if (d->refs == 0 && (victim == NULL || d->body == NULL ||
+					(victim->body != NULL && d->used < victim->used)))
+			victim = d;
+	}
+	if (victim == NULL) {
+		fprintf(stderr, "Error: too many here-documents\n");
+		return NULL;
+	}
+	if (victim->body != NULL && victim->memfd >= 0)
+		close(victim->memfd);
+	free(victim->body);
+	victim->memfd = -1;
+	if ((victim->body = malloc(len + nl + 1)) == NULL) {
+		fprintf(stderr, "Error: here-document too large\n");
+		return NULL;
+	}
+	memcpy(victim->body, s, len);
+	if (nl)
+		victim->body[len] = '\n';
+	victim->body[len + nl] = '\0';
+	victim->len = len + nl;
+	victim->hash = h;
+	victim->used = ++heredocclock;
+	heredocstats.bodies++;
+	return victim;
+}
+
+/* heredocseal - Give a body its sealed memfd */
+	static int 
+heredocseal(struct heredoc_t *d)
+{
+	size_t off;
+	ssize_t n;
+	int fd;
+
+	if ((fd = memfd_create("tsh-heredoc", MFD_CLOEXEC|MFD_ALLOW_SEALING)) < 0)
+		return -1;
+	for (off = 0; off < d->len; off += n)
+		if ((n = write(fd, d->body + off, d->len - off)) < 0) {
+			close(fd);
+			return -1;
+		}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|
+				F_SEAL_SEAL) < 0) {
+		close(fd);
+		return -1;
+	}
+	d->memfd = fd;
+	heredocstats.sealed++;
+	return 0;
+}
+
+/*
+ * heredocfd - A new descriptor reading the body of d from its start,
+ *     -1 (with errno set) if there cannot be one
+ */
+	int 
+heredocfd(struct heredoc_t *d)
+{
+	char path[32];
+	size_t off;
+	ssize_t n;
+	int pfd[2];
+
+	if (d->memfd < 0 && d->len <= HEREPIPE) {
+		if (pipe2(pfd, O_CLOEXEC) < 0)
+			return -1;
+		/* A pipe may have been given less than the usual room */
+		if (fcntl(pfd[1], F_GETPIPE_SZ) >= (int) d->len) {
+			for (off = 0; off < d->len; off += n)
+				if ((n = write(pfd[1], d->body + off, d->len - off)) < 0)
+					break;
+			close(pfd[1]);
+			heredocstats.piped++;
+			return pfd[0];
+		}
+		close(pfd[0]);
+		close(pfd[1]);
+	}
+	if (d->memfd < 0 && heredocseal(d) < 0)
+		return -1;
+	heredocstats.opened++;
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", d->memfd);
+	return open(path, O_RDONLY|O_CLOEXEC);
+}
+
+/*
+ * heredocread - Read the bodies of the here-documents of cmdline, which
+ *     follow it in the input, and make them the bodies of the line.
+ *     With prompt, "> " is printed before each line of a body.  Returns
+ *     -1 if a body cannot be kept.
+ */
+	int 
+heredocread(const char *cmdline, int prompt)
+{
+	static char *buf;
+	static size_t cap;
+	char delim[MAXLINE], line[MAXLINE], *t;
+	const char *p = cmdline, *q, *l;
+	size_t len, n;
+	int strip, i;
+
+	/* The bodies of the last line are no longer needed */
+	for (i = 0; i < nlinedocs; i++)
+		linedocs[i]->refs--;
+	nlinedocs = nextdoc = 0;
+
+	while (*p != '\0') {
+		if (*p == '\'' || *p == '"') {
+			if ((q = quoteend(p + 1, *p)) == NULL)
+				return 0;       /* for parseline to report */
+			p = q + 1;
+			continue;
+		}
+		if (p[0] != '<' || p[1] != '<') {
+			p++;
+			continue;
+		}
+		if (p[2] == '<') {      /* a here-string */
+			p += 3;
+			continue;
+		}
+		p += 2;
+		if ((strip = *p == '-'))
+			p++;
+		p += strspn(p, " \t");
+
+		/* The delimiter, without its quotes */
+		for (n = 0; *p != '\0' && !isspace((unsigned char) *p) &&
+				strchr(";&|()<>", *p) == NULL; ) {
+			if (*p == '\'' || *p == '"') {
+				if ((q = quoteend(p + 1, *p)) == NULL)
+					return 0;
+				memcpy(delim + n, p + 1, q - p - 1);
+				n += q - p - 1;
+				p = q + 1;
+			} else
+				delim[n++] = *p++;
+		}
+		delim[n] = '\0';
+		if (n == 0)
+			return 0;
+		if (nlinedocs == MAXREDIRS) {
+			fprintf(stderr, "Error: too many here-documents\n");
+			return -1;
+		}
+
+		for (len = 0; ; len += n) {
+			if (prompt) {
+				printf("> ");
+				fflush(stdout);
+			}
+			if (!readcmd(line)) {
+				fprintf(stderr, "Warning: here-document delimited by "
+						"end-of-file (wanted '%s')\n", delim);
+				break;
+			}
+			line[strcspn(line, "\n")] = '\0';
+			tracerec('h', line);
+			l = strip ? line + strspn(line, "\t") : line;
+			if (!strcmp(l, delim))
+				break;
+			n = strlen(l);
+			if (len + n + 1 > HEREMAX) {
+				fprintf(stderr, "Error: here-document too large\n");
+				return -1;
+			}
+			if (len + n + 1 > cap) {
+				if ((t = realloc(buf, 2 * (len + n + 1))) == NULL) {
+					fprintf(stderr, "Error: here-document too large\n");
+					return -1;
+				}
+				buf = t;
+				cap = 2 * (len + n + 1);
+			}
+			memcpy(buf + len, l, n);
+			buf[len + n++] = '\n';
+		}
+		if ((linedocs[nlinedocs] = heredocget(buf, len, 0)) == NULL)
+			return -1;
+		linedocs[nlinedocs++]->refs++;
+	}
+	return 0;
+}
+
+/*****************
+ * Simple utilities
+ *****************/
+
+/*
+ * echo, printf, test and [, true, false, pwd and sleep are common enough
+ * in scripts that a fork and exec for each of them costs more than the
+ * work they do.  A foreground command naming one of them, either bare or
+ * as /bin/NAME or /usr/bin/NAME, runs in the shell itself, with its
+ * redirections applied to the shell's descriptors like those of any
+ * builtin.  One that has to be a job of its own (ended by &, with a time
+ * limit, or started by the daemon or the dag builtin) is still forked,
+ * but the child runs the utility instead of exec'ing it.  The versions
+ * here follow the GNU coreutils ones.  "enable -n NAME" switches a
+ * utility off, so that the real program is run again.
+ *
+ * sleep is always forked, even in the foreground: it is the command most
+ * often stopped with ctrl-z, and a sleep in the shell would leave no
+ * process to stop.  It still saves the exec.
+ */
+
+/* findutil - The enabled utility that name runs, or NULL */
+	struct util_t *
+findutil(const char *name)
+{
+	int i;
+
+	if (!strncmp(name, "/bin/", 5))
+		name += 5;
+	else if (!strncmp(name, "/usr/bin/", 9))
+		name += 9;
+	if (strchr(name, '/') != NULL)
+		return NULL;
+	for (i = 0; utils[i].name != NULL; i++)
+		if (!strcmp(utils[i].name, name))
+			return utils[i].enabled ? &utils[i] : NULL;
+	return NULL;
+}
+
+/* runutil - Run utility u in the shell and return its exit status */
+	int 
+runutil(struct util_t *u, struct cmdline_tokens *tok)
+{
+	int status;
+
+	status = u->fn(tok->argc, tok->argv);
+	fflush(stdout);
+	return status;
+}
+
+/*
+ * putescape - Print the backslash escape at s (just after the \) and
+ *     return its length.  With echo set, octal escapes are written \0NNN
+ *     as for echo -e and %b, else \NNN as in a printf format.  Sets *stop
+ *     on \c.
+ */
+	static int 
+putescape(const char *s, int echo, int *stop)
+{
+	static const char from[] = "\\abefnrtv", to[] = "\\\a\b\033\f\n\r\t\v";
+	const char *p = s;
+	int c = 0, n;
+
+	if (*p == 'c') {
+		*stop = 1;
+		return 1;
+	}
+	if (*p != '\0' && strchr(from, *p) != NULL) {
+		putchar(to[strchr(from, *p) - from]);
+		return 1;
+	}
+	if (*p == 'x' && isxdigit((unsigned char) p[1])) {
+		for (p++, n = 0; n < 2 && isxdigit((unsigned char) *p); n++, p++)
+			c = c * 16 + (isdigit((unsigned char) *p) ? *p - '0' :
+					tolower((unsigned char) *p) - 'a' + 10);
+		putchar(c);
+		return p - s;
+	}
+	if ((echo && *p == '0') || (!echo && *p >= '0' && *p <= '7')) {
+		if (echo)
+			p++;
+		for (n = 0; n < 3 && *p >= '0' && *p <= '7'; n++, p++)
+			c = c * 8 + *p - '0';
+		putchar(c);
+		return p - s;
+	}
+	/* Not an escape after all */
+	putchar('\\');
+	return 0;
+}
+
+/* putescaped - Print s with its backslash escapes expanded */
+	static void 
+putescaped(const char *s, int echo, int *stop)
+{
+	while (*s != '\0' && !*stop) {
+		if (*s == '\\' && s[1] != '\0')
+			s += 1 + putescape(s + 1, echo, stop);
+		else
+			putchar(*s++);
+	}
+}
+
+/* echocmd - echo [-neE] [string ...] */
+	int 
+echocmd(int argc, char **argv)
+{
+	int i = 1, newline = 1, escapes = 0, stop = 0;
+	char *p;
+
+	for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+		for (p = argv[i] + 1; *p == 'n' || *p == 'e' || *p == 'E'; p++)
+			;
+		if (*p != '\0')
+			break;           /* not an option: print it */
+		for (p = argv[i] + 1; *p != '\0'; p++) {
+			if (*p == 'n')
+				newline = 0;
+			else
+				escapes = (*p == 'e');
+		}
+	}
+	for (; i < argc && !stop; i++) {
+		if (escapes)
+			putescaped(argv[i], 1, &stop);
+		else
+			fputs(argv[i], stdout);
+		if (i < argc - 1 && !stop)
+			putchar(' ');
+	}
+	if (newline && !stop)
+		putchar('\n');
+	return 0;
+}
+
+/* printfnum - Parse arg as a printf numeric argument */
+	static int 
+printfnum(const char *arg, long long *ival, double *dval, int fp)
+{
+	char *end;
+
+	if (*arg == '\'' || *arg == '"') {
+		/* The character code of what follows the quote */
+		*ival = (unsigned char) arg[1];
+		*dval = *ival;
+		return 0;
+	}
+	errno = 0;
+	if (fp)
+		*dval = strtod(arg, &end);
+	else
+		*ival = strtoll(arg, &end, 0);
+	if (*arg == '\0' || *end != '\0' || errno) {
+		fprintf(stderr, "printf: %s: expected a numeric value\n", arg);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * printfcmd - printf format [argument ...]
+ *
+ * The format is reused for as long as it consumes arguments.
+ */
+	int 
+printfcmd(int argc, char **argv)
+{
+	char spec[64], *fmt, *p, *q, *s;
+	char **args = argv + 2;
+	int nargs = argc - 2, used = 0, pass, status = 0, stop = 0;
+	long long ival;
+	double dval;
+	int n, star;
+
+	if (argc < 2) {
+		fprintf(stderr, "printf: missing operand\n");
+		return 1;
+	}
+	fmt = argv[1];
+	do {
+		pass = used;
+		for (p = fmt; *p != '\0' && !stop; p++) {
+			if (*p == '\\') {
+				p += putescape(p + 1, 0, &stop);
+				continue;
+			}
+			if (*p != '%') {
+				putchar(*p);
+				continue;
+			}
+			if (p[1] == '%') {
+				putchar('%');
+				p++;
+				continue;
+			}
+
+			/* Copy flags, width and precision, taking * from the arguments */
+			q = spec;
+			*q++ = *p++;
+			while (*p != '\0' && strchr("-+ #0", *p) && q < spec + 8)
+				*q++ = *p++;
+			for (star = 0; star < 2; star++) {
+				if (star == 1) {
+					if (*p != '.')
+						break;
+					*q++ = *p++;
+				}
+				if (*p == '*') {
+					n = 0;
+					if (used < nargs) {
+						if (printfnum(args[used++], &ival, &dval, 0) < 0)
+							status = 1;
+						else
+							n = ival;
+					}
+					q += sprintf(q, "%d", n);
+					p++;
+				} else
+					while (isdigit((unsigned char) *p) && q < spec + 40)
+						*q++ = *p++;
+			}
+			while (*p != '\0' && strchr("hlLqjzt", *p))
+				p++;
+
+			s = used < nargs ? args[used] : NULL;
+			if (s != NULL)
+				used++;
+			switch (*p) {
+				case 'd': case 'i':
+					ival = 0;
+					if (s != NULL && printfnum(s, &ival, &dval, 0) < 0)
+						status = 1;
+					strcpy(q, "lld");
+					printf(spec, ival);
+					break;
+				case 'o': case 'u': case 'x': case 'X':
+					ival = 0;
+					if (s != NULL && printfnum(s, &ival, &dval, 0) < 0)
+						status = 1;
+					sprintf(q, "ll%c", *p);
+					printf(spec, (unsigned long long) ival);
+					break;
+				case 'e': case 'E': case 'f': case 'F':
+				case 'g': case 'G': case 'a': case 'A':
+					dval = 0;
+					if (s != NULL && printfnum(s, &ival, &dval, 1) < 0)
+						status = 1;
+					sprintf(q, "%c", *p);
+					printf(spec, dval);
+					break;
+				case 'c':
+					strcpy(q, "c");
+					printf(spec, s != NULL ? *s : '\0');
+					break;
+				case 's':
+					strcpy(q, "s");
+					printf(spec, s != NULL ? s : "");
+					break;
+				case 'b':
+					/* Escapes in the argument; width does not apply */
+					if (s != NULL)
+						putescaped(s, 1, &stop);
+					break;
+				default:
+					fprintf(stderr, "printf: %%%c: invalid conversion\n", *p);
+					return 1;
+			}
+		}
+	} while (used > pass && used < nargs && !stop);
+	return status;
+}
+
+/*
+ * test and [ - Evaluate an expression of the usual primaries, ! ( ) -a
+ *     and -o.  testor and friends are a recursive descent parser over
+ *     targv[tpos..targc-1].  An operand that could be an operator is taken
+ *     as a string when there is nothing left for the operator to act on,
+ *     so "test -n" and "test !" are true like anywhere else.
+ */
+static char **targv;
+static int targc, tpos, terr;
+
+static int testor(void);
+
+/* testint - Parse s as an integer operand of test */
+	static long long 
+testint(const char *s)
+{
+	char *end;
+	long long v;
+
+	errno = 0;
+	v = strtoll(s, &end, 10);
+	while (isspace((unsigned char) *end))
+		end++;
+	if (*s == '\0' || *end != '\0' || errno) {
+		fprintf(stderr, "test: %s: integer expression expected\n", s);
+		terr = 1;
+	}
+	return v;
+}
+
+/* testunary - Is op a unary primary of test? */
+	static int 
+testunary(const char *op)
+{
+	return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+		strchr("nzefdrwxsLhbcpSgukt", op[1]) != NULL;
+}
+
+/* testbinary - Is op a binary primary of test? */
+	static int 
+testbinary(const char *op)
+{
+	static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne",
+		"-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+	int i;
+
+	for (i = 0; ops[i] != NULL; i++)
+		if (!strcmp(op, ops[i]))
+			return 1;
+	return 0;
+}
+
+/* testprimary - A primary, ( expression ) or ! followed by either */
+	static int 
+testprimary(void)
+{
+	struct stat st, st2;
+	char *a, *op, *b;
+	int r, s1, s2;
+
+	if (tpos >= targc) {
+		fprintf(stderr, "test: argument expected\n");
+		terr = 1;
+		return 0;
+	}
+	a = targv[tpos];
+	if (tpos + 2 < targc && testbinary(targv[tpos + 1])) {
+		op = targv[tpos + 1];
+		b = targv[tpos + 2];
+		tpos += 3;
+		if (!strcmp(op, "=") || !strcmp(op, "=="))
+			return !strcmp(a, b);
+		if (!strcmp(op, "!="))
+			return strcmp(a, b) != 0;
+		if (!strcmp(op, "<"))
+			return strcmp(a, b) < 0;
+		if (!strcmp(op, ">"))
+			return strcmp(a, b) > 0;
+		if (!strcmp(op, "-eq"))
+			return testint(a) == testint(b);
+		if (!strcmp(op, "-ne"))
+			return testint(a) != testint(b);
+		if (!strcmp(op, "-lt"))
+			return testint(a) < testint(b);
+		if (!strcmp(op, "-le"))
+			return testint(a) <= testint(b);
+		if (!strcmp(op, "-gt"))
+			return testint(a) > testint(b);
+		if (!strcmp(op, "-ge"))
+			return testint(a) >= testint(b);
+		s1 = stat(a, &st);
+		s2 = stat(b, &st2);
+		if (!strcmp(op, "-ef"))
+			return s1 == 0 && s2 == 0 && st.st_dev == st2.st_dev &&
+				st.st_ino == st2.st_ino;
+		if (!strcmp(op, "-nt"))
+			return s1 == 0 && (s2 < 0 || st.st_mtim.tv_sec > st2.st_mtim.tv_sec ||
+					(st.st_mtim.tv_sec == st2.st_mtim.tv_sec &&
+					 st.st_mtim.tv_nsec > st2.st_mtim.tv_nsec));
+		/* -ot */
+		return s2 == 0 && (s1 < 0 || st.st_mtim.tv_sec < st2.st_mtim.tv_sec ||
+				(st.st_mtim.tv_sec == st2.st_mtim.tv_sec &&
+				 st.st_mtim.tv_nsec < st2.st_mtim.tv_nsec));
+	}
+	if (!strcmp(a, "!") && tpos + 1 < targc) {
+		tpos++;
+		return !testprimary();
+	}
+	if (!strcmp(a, "(") && tpos + 1 < targc) {
+		tpos++;
+		r = testor();
+		if (tpos >= targc || strcmp(targv[tpos], ")")) {
+			fprintf(stderr, "test: missing )\n");
+			terr = 1;
+		}
+		tpos++;
+		return r;
+	}
+	if (testunary(a) && tpos + 1 < targc) {
+		b = targv[tpos + 1];
+		tpos += 2;
+		switch (a[1]) {
+			case 'n': return *b != '\0';
+			case 'z': return *b == '\0';
+			case 't': return isatty(testint(b));
+			case 'r': return access(b, R_OK) == 0;
+			case 'w': return access(b, W_OK) == 0;
+			case 'x': return access(b, X_OK) == 0;
+			case 'L': case 'h':
+				return lstat(b, &st) == 0 && S_ISLNK(st.st_mode);
+		}
+		if (stat(b, &st) < 0)
+			return 0;
+		switch (a[1]) {
+			case 'f': return S_ISREG(st.st_mode);
+			case 'd': return S_ISDIR(st.st_mode);
+			case 's': return st.st_size > 0;
+			case 'b': return S_ISBLK(st.st_mode);
+			case 'c': return S_ISCHR(st.st_mode);
+			case 'p': return S_ISFIFO(st.st_mode);
+			case 'S': return S_ISSOCK(st.st_mode);
+			case 'g': return (st.st_mode & S_ISGID) != 0;
+			case 'u': return (st.st_mode & S_ISUID) != 0;
+			case 'k': return (st.st_mode & S_ISVTX) != 0;
+			default:  return 1;  /* -e */
+		}
+	}
+	/* A lone string is true if it is not empty */
+	tpos++;
+	return *a != '\0';
+}
+
+/* testand - primary { -a primary } */
+	static int 
+testand(void)
+{
+	int r = testprimary();
+
+	while (tpos + 1 < targc && !strcmp(targv[tpos], "-a")) {
+		tpos++;
+		r = testprimary() && r;
+	}
+	return r;
+}
+
+/* testor - and { -o and } */
+	static int 
+testor(void)
+{
+	int r = testand();
+
+	while (tpos + 1 < targc && !strcmp(targv[tpos], "-o")) {
+		tpos++;
+		r = testand() || r;
+	}
+	return r;
+}
+
+/* testcmd - test expression, or [ expression ] */
+	int 
+testcmd(int argc, char **argv)
+{
+	int r;
+
+	if (!strcmp(argv[0] + strlen(argv[0]) - 1, "[")) {
+		if (strcmp(argv[argc - 1], "]")) {
+			fprintf(stderr, "[: missing ]\n");
+			return 2;
+		}
+		argc--;
+	}
+	if (argc == 1)
+		return 1;            /* no expression is false */
+	targv = argv;
+	targc = argc;
+	tpos = 1;
+	terr = 0;
+	r = testor();
+	if (!terr && tpos < targc) {
+		fprintf(stderr, "test: %s: unexpected operator\n", targv[tpos]);
+		terr = 1;
+	}
+	return terr ? 2 : !r;
+}
+
+/* truecmd, falsecmd - Do nothing, successfully or not */
+	int 
+truecmd(int argc, char **argv)
+{
+	return 0;
+}
+
+	int 
+falsecmd(int argc, char **argv)
+{
+	return 1;
+}
+
+/* pwdcmd - Print the working directory */
+	int 
+pwdcmd(int argc, char **argv)
+{
+	char buf[MAXLINE * 4];
+
+	if (getcwd(buf, sizeof(buf)) == NULL) {
+		fprintf(stderr, "pwd: %s\n", strerror(errno));
+		return 1;
+	}
+	puts(buf);
+	return 0;
+}
+
+/*
+ * sleepcmd - sleep DURATION...  Durations are added up and take the
+ *     suffixes s, m, h and d.  Runs in a child of its own (see above).
+ */
+	int 
+sleepcmd(int argc, char **argv)
+{
+	struct timespec ts, left;
+	double total = 0, v;
+	char *end;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "sleep: missing operand\n");
+		return 1;
+	}
+	for (i = 1; i < argc; i++) {
+		v = strtod(argv[i], &end);
+		if (end == argv[i] || v < 0 || (end[0] != '\0' && end[1] != '\0') ||
+				(end[0] != '\0' && strchr("smhd", end[0]) == NULL)) {
+			fprintf(stderr, "sleep: invalid time interval '%s'\n", argv[i]);
+			return 1;
+		}
+		total += v * (*end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 1);
+	}
+
+	/* Being stopped and continued interrupts us */
+	ts.tv_sec = total;
+	ts.tv_nsec = (total - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &left) < 0 && errno == EINTR)
+		ts = left;
+	return 0;
+}
+
+/*
+ * enablecmd - The enable builtin: "enable [-n] NAME..." switches
+ *     utilities on or (with -n) off; without names it lists them.
+ */
+	int 
+enablecmd(struct cmdline_tokens *tok)
+{
+	int i, j, on = 1, first = 1, status = 0;
+
+	if (tok->argc > 1 && !strcmp(tok->argv[1], "-n")) {
+		on = 0;
+		first = 2;
+	}
+	if (tok->argc == first) {
+		for (i = 0; utils[i].name != NULL; i++)
+			if (on || !utils[i].enabled)
+				printf("enable %s%s\n", utils[i].enabled ? "" : "-n ",
+						utils[i].name);
+		return 0;
+	}
+	for (j = first; j < tok->argc; j++) {
+		for (i = 0; utils[i].name != NULL; i++)
+			if (!strcmp(utils[i].name, tok->argv[j]))
+				break;
+		if (utils[i].name == NULL) {
+			printf("enable: %s: not a shell builtin\n", tok->argv[j]);
+			status = 1;
+		} else
+			utils[i].enabled = on;
+	}
+	return status;
+}
+
+/*****************
+ * Command substitution
+ *****************/
+
+/*
+ * parseline replaces $(command) in a word by the output of command,
+ * less its trailing newlines.  Outside double quotes the word is then
+ * split into fields at blanks, each becoming an argument; inside double
+ * quotes it stays one argument.  command may be a whole command list and
+ * may hold substitutions of its own.
+ *
+ * A simple command that is a builtin or an in-process utility (see
+ * findutil) runs right here in the shell with its stdout on a memfd, as
+ * a pipe would fill up with nobody to read it.  Anything else runs in a
+ * forked copy of the shell, set up like the runner of a background list,
+ * which writes into a pipe that the shell reads into a growable buffer.
+ * Nothing touches the file system either way.  SIGCHLD stays blocked
+ * meanwhile so that sigchld_handler cannot reap the copy.
+ *
+ * Each nesting level has a buffer and a memfd of its own, and parseline
+ * a copy of the command line of its own, since an inner command is
+ * parsed while the outer one is still being parsed.
+ */
+
+/* quoteend - Given p just past an opening quote q, the closing quote */
+	const char *
+quoteend(const char *p, int q)
+{
+	for (; *p != '\0'; p++) {
+		if (*p == q)
+			return p;
+		/* A substitution inside double quotes may hold quotes too */
+		if (q == '"' && p[0] == '$' && p[1] == '(' &&
+				(p = substend(p + 2)) == NULL)
+			return NULL;
+	}
+	return NULL;
+}
+
+/* substend - Given p just past "$(", the matching ")" or NULL */
+	const char *
+substend(const char *p)
+{
+	int depth = 1;
+
+	for (; *p != '\0'; p++) {
+		if (*p == '\'' || *p == '"') {
+			if ((p = quoteend(p + 1, *p)) == NULL)
+				return NULL;
+		} else if (*p == '(')
+			depth++;
+		else if (*p == ')' && --depth == 0)
+			return p;
+	}
+	return NULL;
+}
+
+/* substappend - Append len bytes of s to the buffer b */
+	static int 
+substappend(struct substbuf_t *b, const char *s, size_t len)
+{
+	char *p;
+	size_t cap;
+
+	if (b->len + len > SUBSTMAX) {
+		(void) fprintf(stderr, "Error: command substitution output too large\n");
+		return -1;
+	}
+	if (b->len + len > b->cap) {
+		for (cap = b->cap ? b->cap : 256; cap < b->len + len; cap *= 2)
+			;
+		if ((p = realloc(b->buf, cap)) == NULL) {
+			(void) fprintf(stderr, "Error: out of memory\n");
+			return -1;
+		}
+		b->buf = p;
+		b->cap = cap;
+	}
+	memcpy(b->buf + b->len, s, len);
+	b->len += len;
+	return 0;
+}
+
+/*
+ * substsimple - Can cmd run in the shell?  It has to be a single command
+ *     starting with a builtin that cannot take over the shell, or with a
+ *     utility.
+ */
+	static int 
+substsimple(const char *cmd)
+{
+	static const char *ok[] = { "jobs", "stats", "enable", "tail", "dump",
+		"capture", "admit", NULL };
+	char word[MAXLINE];
+	size_t n;
+	int i;
+
+	if (strpbrk(cmd, ";&|()$<'\"") != NULL)
+		return 0;
+	cmd += strspn(cmd, " \t\r\n");
+	n = strcspn(cmd, " \t\r\n");
+	if (n == 0 || n >= sizeof(word))
+		return 0;
+	memcpy(word, cmd, n);
+	word[n] = '\0';
+	for (i = 0; ok[i] != NULL; i++)
+		if (!strcmp(word, ok[i]))
+			return 1;
+	return findutil(word) != NULL;
+}
+
+/* substinproc - Run cmd in the shell, appending its output to b */
+	static int 
+substinproc(char *cmd, struct substbuf_t *b)
+{
+	int *fd = &substfds[substdepth - 1];
+	char chunk[4096];
+	ssize_t n;
+	off_t off = 0;
+	int saved;
+
+	if (*fd < 0 && (*fd = memfd_create("tsh-subst", MFD_CLOEXEC)) < 0)
+		return -1;
+	if (ftruncate(*fd, 0) < 0 || lseek(*fd, 0, SEEK_SET) < 0)
+		return -1;
+	fflush(stdout);
+	if ((saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10)) < 0)
+		return -1;
+	dup2(*fd, STDOUT_FILENO);
+	runcmd(cmd);
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	while ((n = pread(*fd, chunk, sizeof(chunk), off)) > 0) {
+		if (substappend(b, chunk, n) < 0)
+			return -2;
+		off += n;
+	}
+	return 0;
+}
+
+/* substfork - Run cmd in a copy of the shell, appending its output to b */
+	static int 
+substfork(char *cmd, struct substbuf_t *b)
+{
+	struct cmdnode_t *list;
+	char chunk[4096];
+	sigset_t mask, oldmask;
+	int pfd[2], status, rc = 0, listbg;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe2(pfd, O_CLOEXEC) < 0) {
+		(void) fprintf(stderr, "Error: pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	if ((pid = Fork()) == 0) {
+		/* Like the runner of a background list, but it stays in our
+		 * process group so that ctrl-c reaches it */
+		dup2(pfd[1], STDOUT_FILENO);
+		Signal(SIGCHLD, SIG_DFL);
+		Signal(SIGINT, SIG_DFL);
+		Signal(SIGTSTP, SIG_DFL);
+		Signal(SIGIO, SIG_IGN);
+		Sigprocmask(SIG_SETMASK, &oldmask, NULL);
+		initjobs(job_list);
+		wheel_reset();
+		listrunner = 1;
+		substdepth = 0;
+		status = (list = parselist(cmd, &listbg)) ? runlist(list) : 2;
+		fflush(stdout);
+		_exit(status);
+	}
+	close(pfd[1]);
+	while ((n = read(pfd[0], chunk, sizeof(chunk))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (substappend(b, chunk, n) < 0) {
+			kill(pid, SIGKILL);
+			rc = -1;
+			break;
+		}
+	}
+	close(pfd[0]);
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	Sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	return rc;
+}
+
+/*
+ * substword - Expand the substitutions in word.  Returns the result,
+ *     stored in xarena, or NULL on error.
+ */
+	char *
+substword(char *word)
+{
+	struct substbuf_t *b;
+	char *p, *end;
+	int state = parsing_state, rc;
+
+	if (substdepth == MAXSUBST) {
+		(void) fprintf(stderr, "Error: command substitutions nested too deeply\n");
+		return NULL;
+	}
+	b = &substbufs[substdepth++];
+	b->len = 0;
+	for (p = word, rc = 0; *p != '\0' && rc == 0; ) {
+		if (p[0] != '$' || p[1] != '(') {
+			end = p + 1;
+			while (*end != '\0' && (end[0] != '$' || end[1] != '('))
+				end++;
+			rc = substappend(b, p, end - p);
+			p = end;
+			continue;
+		}
+		end = (char *) substend(p + 2);
+		*end = '\0';
+		rc = substsimple(p + 2) ? substinproc(p + 2, b) : -1;
+		if (rc == -1)
+			rc = substfork(p + 2, b);
+		while (b->len > 0 && b->buf[b->len - 1] == '\n')
+			b->len--;
+		p = end + 1;
+	}
+	substdepth--;
+	parsing_state = state;
+	if (rc < 0)
+		return NULL;
+	if ((p = xstrdup(b->len ? b->buf : "", b->len)) == NULL)
+		(void) fprintf(stderr, "Error: too many arguments\n");
+	return p;
+}
+
+/*
+ * splitfields - Add the blank-separated fields of s to tok->argv,
+ *     terminating them in place.
+ */
+	int 
+splitfields(char *s, struct cmdline_tokens *tok)
+{
+	const char blanks[] = " \t\r\n";
+	char *end;
+
+	for (s += strspn(s, blanks); *s != '\0'; s = end + strspn(end, blanks)) {
+		if (tok->argc >= MAXARGS - 1) {
+			(void) fprintf(stderr, "Error: too many arguments\n");
+			return -1;
+		}
+		tok->argv[tok->argc++] = s;
+		end = s + strcspn(s, blanks);
+		if (*end != '\0')
+			*end++ = '\0';
+	}
+	return 0;
+}
+
+/*****************
+ * Command lists
+ *****************/
+
+/*
+ * A command list is lexed into words (the simple commands, handed to
+ * runcmd as they are) and the operators ; && || ( ) and a final &, and
+ * parsed into a tree of cmdnode_t with the usual shell grammar:
+ *
+ *     list    := andor { ; andor } [;]
+ *     andor   := primary { (&& | ||) primary }
+ *     primary := ( list ) | command
+ *
+ * && and || have equal precedence and group to the left.  A & directly
+ * after > or < (as in 2>&1) belongs to the word, as does all of a $(...).
+ */
+
+/* lexlist - Split buf into list tokens, writing NULs after the words */
+	static int 
+lexlist(char *buf, struct ltoken_t *toks)
+{
+	char *p = buf, *word = NULL, *q;
+	int n = 0, type, len;
+
+	while (1) {
+		if (*p == '\'' || *p == '"') {
+			if ((q = (char *) quoteend(p + 1, *p)) == NULL) {
+				(void) fprintf(stderr, "Error: unmatched %c.\n", *p);
+				return -1;
+			}
+			if (word == NULL)
+				word = p;
+			p = q + 1;
+			continue;
+		}
+		if (*p == '$' && p[1] == '(') {
+			/* A substitution belongs to the word, operators and all */
+			if ((q = (char *) substend(p + 2)) == NULL) {
+				(void) fprintf(stderr, "Error: unmatched $(.\n");
+				return -1;
+			}
+			if (word == NULL)
+				word = p;
+			p = q + 1;
+			continue;
+		}
+		len = 1;
+		if (*p == '\0')
+			type = L_END;
+		else if (*p == ';')
+			type = L_SEMI;
+		else if (*p == '&' && p[1] == '&')
+			type = L_AND, len = 2;
+		else if (*p == '|' && p[1] == '|')
+			type = L_OR, len = 2;
+		else if (*p == '(')
+			type = L_LPAREN;
+		else if (*p == ')')
+			type = L_RPAREN;
+		else if (*p == '&' && !(p > buf && (p[-1] == '>' || p[-1] == '<')))
+			type = L_BG;
+		else {
+			if (word == NULL && !isspace((unsigned char) *p))
+				word = p;
+			p++;
+			continue;
+		}
+
+		if (n >= MAXLTOKS - 2) {
+			(void) fprintf(stderr, "Error: command list too long\n");
+			return -1;
+		}
+		if (word != NULL) {
+			toks[n].type = L_WORD;
+			toks[n++].text = word;
+			word = NULL;
+		}
+		toks[n++].type = type;
+		if (type == L_END)
+			return n;
+		*p = '\0';
+		p += len;
+	}
+}
+
+/* newnode - Allocate a list node from the pool */
+	static struct cmdnode_t *
+newnode(int type, char *cmd, struct cmdnode_t *left, struct cmdnode_t *right)
+{
+	struct cmdnode_t *n;
+
+	if (nnodes >= MAXNODES)
+		return NULL;
+	n = &nodes[nnodes++];
+	n->type = type;
+	n->cmd = cmd;
+	n->left = left;
+	n->right = right;
+	return n;
+}
+
+static struct cmdnode_t *parse_list(struct ltoken_t **t);
+
+/* parse_primary - primary := ( list ) | command */
+	static struct cmdnode_t *
+parse_primary(struct ltoken_t **t)
+{
+	struct cmdnode_t *n;
+
+	if ((*t)->type == L_WORD)
+		return newnode(N_CMD, (*t)++->text, NULL, NULL);
+	if ((*t)->type != L_LPAREN)
+		return NULL;
+	(*t)++;
+	if ((n = parse_list(t)) == NULL || (*t)->type != L_RPAREN)
+		return NULL;
+	(*t)++;
+	return newnode(N_GROUP, NULL, n, NULL);
+}
+
+/* parse_andor - andor := primary { (&& | ||) primary } */
+	static struct cmdnode_t *
+parse_andor(struct ltoken_t **t)
+{
+	struct cmdnode_t *n, *right;
+	int type;
+
+	if ((n = parse_primary(t)) == NULL)
+		return NULL;
+	while ((*t)->type == L_AND || (*t)->type == L_OR) {
+		type = (*t)++->type == L_AND ? N_AND : N_OR;
+		if ((right = parse_primary(t)) == NULL)
+			return NULL;
+		if ((n = newnode(type, NULL, n, right)) == NULL)
+			return NULL;
+	}
+	return n;
+}
+
+/* parse_list - list := andor { ; andor } [;] */
+	static struct cmdnode_t *
+parse_list(struct ltoken_t **t)
+{
+	struct cmdnode_t *n, *right;
+
+	if ((n = parse_andor(t)) == NULL)
+		return NULL;
+	while ((*t)->type == L_SEMI) {
+		(*t)++;
+		if ((*t)->type == L_END || (*t)->type == L_RPAREN ||
+				(*t)->type == L_BG)
+			break;
+		if ((right = parse_andor(t)) == NULL)
+			return NULL;
+		if ((n = newnode(N_SEQ, NULL, n, right)) == NULL)
+			return NULL;
+	}
+	return n;
+}
+
+/*
+ * parselist - Parse a command line into a command list tree.  *bg is set
+ *     if the list ends with &.  Returns NULL (after printing an error)
+ *     if the line is malformed or blank.  The tree and its strings are
+ *     statically allocated and overwritten by the next call.
+ */
+	struct cmdnode_t *
+parselist(const char *cmdline, int *bg)
+{
+	static char buf[MAXLINE];
+	struct ltoken_t toks[MAXLTOKS], *t = toks;
+	struct cmdnode_t *n;
+
+	strncpy(buf, cmdline, MAXLINE - 1);
+	buf[MAXLINE - 1] = '\0';
+	nnodes = 0;
+	if (lexlist(buf, toks) < 0)
+		return NULL;
+	if (t->type == L_END)
+		return NULL;                    /* ignore blank line */
+	n = parse_list(&t);
+	if ((*bg = (t->type == L_BG)))
+		t++;
+	if (n == NULL || t->type != L_END) {
+		if (nnodes >= MAXNODES)
+			(void) fprintf(stderr, "Error: command list too long\n");
+		else
+			(void) fprintf(stderr, "Error: syntax error near '%s'\n",
+					t->type == L_WORD ? t->text : ltokname[t->type]);
+		return NULL;
+	}
+	return n;
+}
+
+/* exitcode - The shell exit status of a child's wait status */
+	int 
+exitcode(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	if (WIFSTOPPED(status))
+		return 128 + WSTOPSIG(status);
+	return 1;
+}
+
+/*
+ * runlist - Run a command list and return the exit status of the last
+ *     command run.  && and || look at the status of their left side to
+ *     decide whether to run the right one.  A command killed by ctrl-c
+ *     ends the whole list.  Groups run in the shell itself.
+ */
+	int 
+runlist(struct cmdnode_t *n)
+{
+	int status;
+
+	switch (n->type) {
+		case N_CMD:
+			fgintr = 0;
+			status = runcmd(n->cmd);
+			fflush(stdout);
+			return status;
+		case N_GROUP:
+			return runlist(n->left);
+		default:
+			status = runlist(n->left);
+			if (fgintr)
+				return status;
+			if ((n->type == N_AND && status != 0) ||
+					(n->type == N_OR && status == 0))
+				return status;
+			return runlist(n->right);
+	}
+}
+
+/*****************
+ * Glob expansion
+ *****************/
+
+/*
+ * Patterns are compiled once per word into a list of path components.
+ * Each component is either a literal name (looked up directly, no
+ * directory scan needed), "**" (matches any number of directories) or
+ * a sequence of match ops.  Directory contents are read with getdents64
+ * in DENTBUF sized batches and kept in a small cache that is validated
+ * against the directory's device, inode and mtime, so that repeated
+ * globs over the same large directories do not rescan them.
+ */
+
+/* Match ops of a compiled glob component */
+#define G_CHAR        0   /* match one literal character */
+#define G_ANY         1   /* ? - match any one character */
+#define G_STAR        2   /* * - match any string */
+#define G_CLASS       3   /* [...] - match one character of a class */
+
+struct globop_t {
+	unsigned char op;       /* G_CHAR, G_ANY, G_STAR or G_CLASS */
+	unsigned char c;        /* literal character or class index */
+};
+
+struct globseg_t {
+	int literal;            /* no wildcards in this component */
+	int globstar;           /* component is exactly "**" */
+	int dotok;              /* component may match names starting with . */
+	char *text;             /* literal text of the component */
+	int start, nops;        /* ops[start .. start+nops) */
+};
+
+struct globpat_t {
+	int nseg;                              /* number of components */
+	int absolute;                          /* pattern starts with / */
+	struct globseg_t seg[MAXGSEG];         /* the components */
+	struct globop_t ops[MAXGOPS];          /* match ops of all components */
+	int nops;
+	unsigned char cls[MAXGCLS][32];        /* [...] class bitmaps */
+	int ncls;
+	char text[MAXLINE];                    /* component strings */
+};
+
+/* A directory listing, shared by the cache and its users */
+struct dirlist_t {
+	int refs;               /* cache slot + walkers using it */
+	dev_t dev;              /* identity of the directory ... */
+	ino_t ino;
+	struct timespec mtime;  /* ... and its last modification */
+	time_t scanned;         /* when the listing was read */
+	int n;                  /* number of entries */
+	int *off;               /* offset of each name in names */
+	unsigned char *type;    /* d_type of each entry */
+	char *names;            /* NUL separated entry names */
+};
+
+struct dircache_t {
+	char *path;             /* directory path as used by the walker */
+	struct dirlist_t *dl;
+	unsigned long used;     /* LRU clock value of the last hit */
+};
+
+/* The result list of a walk */
+struct globres_t {
+	char **v;
+	int n, cap;
+};
+
+/* Work shared by the threads walking a ** pattern */
+struct globwork_t {
+	struct globpat_t *p;
+	int si;                 /* component index of the ** */
+	const char *prefix;     /* path up to the ** */
+	struct dirlist_t *dl;   /* listing whose subdirectories are walked */
+	int *dirs;              /* indices of subdirectories in dl */
+	int ndirs;
+	int next;               /* next subdirectory to hand out */
+	struct globres_t res[MAXGTHREADS];
+};
+
+/* The linux_dirent64 record returned by getdents64 */
+struct dirent64_t {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static struct dircache_t dircache[DIRCACHE];
+static unsigned long dircache_clock;
+static pthread_mutex_t dircache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void glob_walk(struct globpat_t *p, int si, char *path, size_t plen,
+		struct globres_t *r, int depth);
+
+/* xstrdup - Copy len bytes of s into xarena, NULL if it is full */
+	char *
+xstrdup(const char *s, size_t len)
+{
+	char *d;
+
+	if (xused + len + 1 > XARENA)
+		return NULL;
+	d = xarena + xused;
+	memcpy(d, s, len);
+	d[len] = '\0';
+	xused += len + 1;
+	return d;
+}
+
+/* hasglob - Does the word contain wildcard characters? */
+	int 
+hasglob(const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\' && s[1])
+			s++;
+		else if (*s == '*' || *s == '?')
+			return 1;
+		else if (*s == '[' && strchr(s + 1, ']'))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * globcompile - Compile pattern into p.  Returns -1 if the pattern has
+ *     too many components or ops.
+ */
+	static int 
+globcompile(const char *pattern, struct globpat_t *p)
+{
+	char *s, *comp;
+	struct globseg_t *g;
+	unsigned char *set;
+	int neg, lo, hi, i;
+
+	p->nseg = p->nops = p->ncls = 0;
+	p->absolute = (*pattern == '/');
+	strncpy(p->text, pattern, MAXLINE - 1);
+	p->text[MAXLINE - 1] = '\0';
+
+	for (s = p->text; *s; ) {
+		while (*s == '/')
+			s++;
+		if (*s == '\0')
+			break;
+		if (p->nseg >= MAXGSEG)
+			return -1;
+		comp = s;
+		s += strcspn(s, "/");
+		if (*s)
+			*s++ = '\0';
+
+		g = &p->seg[p->nseg++];
+		g->text = comp;
+		g->globstar = !strcmp(comp, "**");
+		g->literal = !g->globstar && !hasglob(comp);
+		g->dotok = (*comp == '.');
+		g->start = p->nops;
+		if (g->literal || g->globstar) {
+			g->nops = 0;
+			continue;
+		}
+
+		while (*comp) {
+			if (p->nops >= MAXGOPS)
+				return -1;
+			if (*comp == '*') {
+				/* Consecutive stars match the same as one */
+				if (p->nops == g->start || 
+						p->ops[p->nops - 1].op != G_STAR)
+					p->ops[p->nops++].op = G_STAR;
+				comp++;
+			} else if (*comp == '?') {
+				p->ops[p->nops++].op = G_ANY;
+				comp++;
+			} else if (*comp == '[' && strchr(comp + 1, ']') &&
+					p->ncls < MAXGCLS) {
+				set = p->cls[p->ncls];
+				memset(set, 0, 32);
+				comp++;
+				neg = (*comp == '!' || *comp == '^');
+				if (neg)
+					comp++;
+				/* A ] right after [ or [! is a member of the class */
+				do {
+					lo = hi = (unsigned char) *comp++;
+					if (*comp == '-' && comp[1] && comp[1] != ']') {
+						hi = (unsigned char) comp[1];
+						comp += 2;
+					}
+					for (i = lo; i <= hi; i++)
+						set[i >> 3] |= 1 << (i & 7);
+				} while (*comp && *comp != ']');
+				if (*comp == ']')
+					comp++;
+				if (neg)
+					for (i = 0; i < 32; i++)
+						set[i] = ~set[i];
+				p->ops[p->nops].op = G_CLASS;
+				p->ops[p->nops++].c = p->ncls++;
+			} else {
+				if (*comp == '\\' && comp[1])
+					comp++;
+				p->ops[p->nops].op = G_CHAR;
+				p->ops[p->nops++].c = *comp++;
+			}
+		}
+		g->nops = p->nops - g->start;
+	}
+	return 0;
+}
+
+/*
+ * globmatch - Match name against a compiled component.  Stars are
+ *     handled by remembering the last one seen and retrying from it,
+ *     which never backtracks further than a single star.
+ */
+	static int 
+globmatch(struct globpat_t *p, struct globseg_t *g, const char *name)
+{
+	struct globop_t *op = &p->ops[g->start], *end = op + g->nops;
+	struct globop_t *star = NULL;
+	const char *retry = NULL;
+	unsigned char c;
+	int ok;
+
+	if (*name == '.' && !g->dotok)
+		return 0;
+
+	while (*name) {
+		if (op < end && op->op == G_STAR) {
+			star = ++op;
+			retry = name;
+			continue;
+		}
+		if (op < end) {
+			c = (unsigned char) *name;
+			switch (op->op) {
+				case G_CHAR:
+					ok = (op->c == c);
+					break;
+				case G_CLASS:
+					ok = (p->cls[op->c][c >> 3] >> (c & 7)) & 1;
+					break;
+				default:
+					ok = 1;
+			}
+			if (ok) {
+				op++;
+				name++;
+				continue;
+			}
+		}
+		if (star == NULL)
+			return 0;
+		op = star;
+		name = ++retry;
+	}
+	while (op < end && op->op == G_STAR)
+		op++;
+	return op == end;
+}
+
+/* dirlist_put - Drop a reference to a directory listing */
+	static void 
+dirlist_put(struct dirlist_t *dl)
+{
+	int last;
+
+	pthread_mutex_lock(&dircache_lock);
+	last = (--dl->refs == 0);
+	pthread_mutex_unlock(&dircache_lock);
+	if (last) {
+		free(dl->off);
+		free(dl->type);
+		free(dl->names);
+		free(dl);
+	}
+}
+
+/* dirlist_scan - Read a whole directory with getdents64 */
+	static struct dirlist_t *
+dirlist_scan(const char *path, struct stat *st)
+{
+	struct dirlist_t *dl;
+	struct dirent64_t *d;
+	char *buf;
+	size_t len, used = 0, size = 4096;
+	int fd, cap = 256;
+	long nread, pos;
+
+	if ((fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+		return NULL;
+	if ((buf = malloc(DENTBUF)) == NULL ||
+			(dl = calloc(1, sizeof(*dl))) == NULL) {
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+	dl->off = malloc(cap * sizeof(int));
+	dl->type = malloc(cap);
+	dl->names = malloc(size);
+
+	while (dl->off && dl->type && dl->names &&
+			(nread = syscall(SYS_getdents64, fd, buf, DENTBUF)) > 0) {
+		for (pos = 0; pos < nread; pos += d->d_reclen) {
+			d = (struct dirent64_t *) (buf + pos);
+			if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+					(d->d_name[1] == '.' && d->d_name[2] == '\0')))
+				continue;
+			len = strlen(d->d_name) + 1;
+			if (dl->n == cap) {
+				cap *= 2;
+				dl->off = realloc(dl->off, cap * sizeof(int));
+				dl->type = realloc(dl->type, cap);
+			}
+			while (used + len > size) {
+				size *= 2;
+				dl->names = realloc(dl->names, size);
+			}
+			if (!dl->off || !dl->type || !dl->names)
+				break;
+			dl->off[dl->n] = used;
+			dl->type[dl->n++] = d->d_type;
+			memcpy(dl->names + used, d->d_name, len);
+			used += len;
+		}
+	}
+	free(buf);
+	close(fd);
+	if (!dl->off || !dl->type || !dl->names) {
+		dl->refs = 1;
+		dirlist_put(dl);
+		return NULL;
+	}
+
+	dl->dev = st->st_dev;
+	dl->ino = st->st_ino;
+	dl->mtime = st->st_mtim;
+	dl->scanned = time(NULL);
+	return dl;
+}
+
+/*
+ * dirlist_get - Return the listing of a directory, from the cache if
+ *     the directory has not changed since it was scanned.  A listing
+ *     taken in the same second as the directory's last modification is
+ *     not trusted, since a later change in that second could leave the
+ *     mtime untouched on file systems with coarse timestamps.
+ */
+	static struct dirlist_t *
+dirlist_get(const char *path)
+{
+	struct stat st;
+	struct dirlist_t *dl, *old = NULL;
+	struct dircache_t *slot, *victim = NULL;
+	int i;
+
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+
+	pthread_mutex_lock(&dircache_lock);
+	for (i = 0; i < DIRCACHE; i++) {
+		slot = &dircache[i];
+		if (slot->path == NULL || strcmp(slot->path, path))
+			continue;
+		dl = slot->dl;
+		if (dl->dev == st.st_dev && dl->ino == st.st_ino &&
+				dl->mtime.tv_sec == st.st_mtim.tv_sec &&
+				dl->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+				dl->scanned > st.st_mtim.tv_sec) {
+			slot->used = ++dircache_clock;
+			dl->refs++;
+			pthread_mutex_unlock(&dircache_lock);
+			return dl;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&dircache_lock);
+
+	if ((dl = dirlist_scan(path, &st)) == NULL)
+		return NULL;
+	dl->refs = 2;           /* one for the cache, one for the caller */
+
+	pthread_mutex_lock(&dircache_lock);
+	for (i = 0; i < DIRCACHE; i++) {
+		slot = &dircache[i];
+		if (slot->path && !strcmp(slot->path, path)) {
+			victim = slot;
+			break;
+		}
+		if (victim == NULL || (victim->path && 
+					(slot->path == NULL || slot->used < victim->used)))
+			victim = slot;
+	}
+	if (victim->path && strcmp(victim->path, path)) {
+		free(victim->path);
+		victim->path = NULL;
+	}
+	if (victim->path == NULL)
+		victim->path = strdup(path);
+	if (victim->dl && --victim->dl->refs == 0)
+		old = victim->dl;
+	victim->dl = dl;
+	victim->used = ++dircache_clock;
+	if (victim->path == NULL) {
+		/* Out of memory: hand out the listing without caching it */
+		victim->dl = NULL;
+		dl->refs--;
+	}
+	pthread_mutex_unlock(&dircache_lock);
+
+	if (old) {
+		old->refs = 1;
+		dirlist_put(old);
+	}
+	return dl;
+}
+
+/* globres_add - Append a copy of path to a result list */
+	static void 
+globres_add(struct globres_t *r, const char *path)
+{
+	char **v;
+
+	if (r->n == r->cap) {
+		r->cap = r->cap ? 2 * r->cap : 64;
+		if ((v = realloc(r->v, r->cap * sizeof(char *))) == NULL)
+			return;
+		r->v = v;
+	}
+	if ((r->v[r->n] = strdup(path)) != NULL)
+		r->n++;
+}
+
+/*
+ * isdir - Is entry i of a listing a directory?  Only entries of
+ *     unknown type or symbolic links need a stat.
+ */
+	static int 
+isdir(struct dirlist_t *dl, int i, const char *path, int follow)
+{
+	struct stat st;
+
+	if (dl->type[i] == DT_DIR)
+		return 1;
+	if (dl->type[i] == DT_UNKNOWN || (follow && dl->type[i] == DT_LNK)) {
+		if ((follow ? stat(path, &st) : lstat(path, &st)) == 0)
+			return S_ISDIR(st.st_mode);
+	}
+	return 0;
+}
+
+/* globstar_thread - Walk the subdirectories handed out by a globwork_t */
+	static void *
+globstar_thread(void *arg)
+{
+	struct globwork_t *w = ((void **) arg)[0];
+	struct globres_t *r = ((void **) arg)[1];
+	char path[MAXLINE];
+	size_t plen = strlen(w->prefix), len;
+	const char *name;
+	int i;
+
+	memcpy(path, w->prefix, plen + 1);
+	while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->ndirs) {
+		name = w->dl->names + w->dl->off[w->dirs[i]];
+		len = strlen(name);
+		if (plen + len + 2 > MAXLINE)
+			continue;
+		memcpy(path + plen, name, len);
+		path[plen + len] = '/';
+		path[plen + len + 1] = '\0';
+		glob_walk(w->p, w->si, path, plen + len + 1, r, 1);
+	}
+	return NULL;
+}
+
+/*
+ * globstar_parallel - Walk the subdirectories of a ** component with
+ *     glob_threads threads, each collecting into its own result list.
+ */
+	static void 
+globstar_parallel(struct globwork_t *w, struct globres_t *r)
+{
+	pthread_t tid[MAXGTHREADS];
+	void *args[MAXGTHREADS][2];
+	int i, j, nthreads = glob_threads;
+
+	if (nthreads > w->ndirs)
+		nthreads = w->ndirs;
+	memset(w->res, 0, sizeof(w->res));
+	for (i = 0; i < nthreads; i++) {
+		args[i][0] = w;
+		args[i][1] = &w->res[i];
+		if (pthread_create(&tid[i], NULL, globstar_thread, args[i]) != 0)
+			break;
+	}
+	/* Whatever could not be handed to a thread is walked here */
+	globstar_thread((void *[]){ w, r });
+	for (j = 0; j < i; j++) {
+		pthread_join(tid[j], NULL);
+		for (int k = 0; k < w->res[j].n; k++) {
+			globres_add(r, w->res[j].v[k]);
+			free(w->res[j].v[k]);
+		}
+		free(w->res[j].v);
+	}
+}
+
+/*
+ * glob_walk - Match components si.. of p below path (which is empty or
+ *     ends with a /), adding every match to r.
+ */
+	static void 
+glob_walk(struct globpat_t *p, int si, char *path, size_t plen,
+		struct globres_t *r, int depth)
+{
+	struct globseg_t *g;
+	struct dirlist_t *dl;
+	struct globwork_t w;
+	struct stat st;
+	const char *name;
+	size_t len;
+	int i, last, ndirs = 0, *dirs = NULL;
+
+	if (si == p->nseg) {
+		if (plen > 0 && path[plen - 1] == '/' && plen > 1)
+			path[--plen] = '\0';
+		globres_add(r, path);
+		return;
+	}
+	g = &p->seg[si];
+	last = (si == p->nseg - 1);
+
+	/* Literal components are looked up, not scanned for */
+	if (g->literal) {
+		len = strlen(g->text);
+		if (plen + len + 2 > MAXLINE)
+			return;
+		memcpy(path + plen, g->text, len + 1);
+		if (last) {
+			if (lstat(path, &st) == 0)
+				globres_add(r, path);
+		} else {
+			path[plen + len] = '/';
+			path[plen + len + 1] = '\0';
+			glob_walk(p, si + 1, path, plen + len + 1, r, depth);
+		}
+		path[plen] = '\0';
+		return;
+	}
+
+	/* "**" also matches zero directories */
+	if (g->globstar && !last)
+		glob_walk(p, si + 1, path, plen, r, depth);
+
+	if ((dl = dirlist_get(plen ? path : ".")) == NULL)
+		return;
+	if (g->globstar && depth == 0 && glob_threads > 1)
+		dirs = malloc(dl->n * sizeof(int));
+
+	for (i = 0; i < dl->n; i++) {
+		name = dl->names + dl->off[i];
+		len = strlen(name);
+		if (plen + len + 2 > MAXLINE)
+			continue;
+		if (g->globstar ? (*name == '.') : !globmatch(p, g, name))
+			continue;
+		memcpy(path + plen, name, len + 1);
+
+		if (g->globstar) {
+			/* A trailing ** matches every name in the tree */
+			if (last)
+				globres_add(r, path);
+			if (isdir(dl, i, path, 0)) {
+				if (dirs) {
+					dirs[ndirs++] = i;
+				} else {
+					path[plen + len] = '/';
+					path[plen + len + 1] = '\0';
+					glob_walk(p, si, path, plen + len + 1, r, depth + 1);
+				}
+			}
+		} else if (last) {
+			globres_add(r, path);
+		} else if (isdir(dl, i, path, 1)) {
+			path[plen + len] = '/';
+			path[plen + len + 1] = '\0';
+			glob_walk(p, si + 1, path, plen + len + 1, r, depth);
+		}
+		path[plen] = '\0';
+	}
+
+	if (dirs) {
+		w.p = p;
+		w.si = si;
+		w.prefix = path;
+		w.dl = dl;
+		w.dirs = dirs;
+		w.ndirs = ndirs;
+		w.next = 0;
+		globstar_parallel(&w, r);
+		free(dirs);
+	}
+	dirlist_put(dl);
+}
+
+	static int 
+globcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * globexpand - Append the paths matching pattern to tok->argv, in sorted
+ *     order.  A pattern that matches nothing is passed on unchanged.
+ *     Returns -1 if the matches do not fit in argv or xarena.
+ */
+	int 
+globexpand(const char *pattern, struct cmdline_tokens *tok)
+{
+	static struct globpat_t pat;
+	struct globres_t r = { NULL, 0, 0 };
+	char path[MAXLINE];
+	int i, rc = 0;
+
+	if (globcompile(pattern, &pat) < 0) {
+		(void) fprintf(stderr, "Error: glob pattern too complex\n");
+		return -1;
+	}
+	strcpy(path, pat.absolute ? "/" : "");
+	glob_walk(&pat, 0, path, strlen(path), &r, 0);
+
+	if (r.n == 0) {
+		tok->argv[tok->argc++] = (char *) pattern;
+		return 0;
+	}
+	qsort(r.v, r.n, sizeof(char *), globcmp);
+	for (i = 0; i < r.n; i++) {
+		if (rc == 0 && (tok->argc >= MAXARGS - 1 ||
+				(tok->argv[tok->argc] = xstrdup(r.v[i], strlen(r.v[i])))
+				== NULL)) {
+			(void) fprintf(stderr, "Error: %s: too many matches\n", pattern);
+			rc = -1;
+		}
+		if (rc == 0)
+			tok->argc++;
+		free(r.v[i]);
+	}
+	free(r.v);
+	return rc;
+}
+
+/*****************
+ * Output capture
+ *****************/
+
+/*
+ * With capture on, the stdout and stderr of each background job go to
+ * a pipe instead of the terminal.  The shell drains the pipe into a ring
+ * buffer of capsize bytes kept in a memfd, overwriting the oldest output
+ * once the ring is full, so a chatty job can neither interleave with
+ * the terminal nor make the shell grow.  Draining happens in the SIGIO
+ * handler (the pipes are O_ASYNC) and once more when the job is reaped.
+ * Captures outlive their jobs until the job ID is reused, so the output
+ * of a finished job can still be looked at with jobs -o, tail and dump.
+ */
+
+/* findcap - Find the capture of job jid, NULL if there is none */
+	static struct capture_t *
+findcap(int jid)
+{
+	int i;
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (captures[i].jid == jid && captures[i].ring != NULL)
+			return &captures[i];
+	return NULL;
+}
+
+/* freecap - Release a capture's pipe and ring */
+	static void 
+freecap(struct capture_t *cap)
+{
+	if (cap->rfd >= 0)
+		close(cap->rfd);
+	if (cap->ring != NULL)
+		munmap(cap->ring, cap->size);
+	if (cap->memfd >= 0)
+		close(cap->memfd);
+	memset(cap, 0, sizeof(*cap));
+	cap->rfd = -1;
+	cap->memfd = -1;
+}
+
+/*
+ * capdrain - Move everything that is ready in the capture pipe into the
+ *     ring.  The pipe is closed once all writers have gone.
+ */
+	static void 
+capdrain(struct capture_t *cap)
+{
+	struct iovec iov[2];
+	size_t tail;
+	ssize_t n;
+
+	while (cap->rfd >= 0) {
+		/* Read as much as fits, starting at the tail and wrapping */
+		tail = (cap->head + cap->len) % cap->size;
+		iov[0].iov_base = cap->ring + tail;
+		iov[0].iov_len = cap->size - tail;
+		iov[1].iov_base = cap->ring;
+		iov[1].iov_len = tail;
+		if ((n = readv(cap->rfd, iov, 2)) > 0) {
+			cap->total += n;
+			if (cap->len + n > cap->size) {
+				cap->len = cap->size;
+				cap->head = (tail + n) % cap->size;
+			} else
+				cap->len += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0 || errno != EAGAIN) {
+			close(cap->rfd);
+			cap->rfd = -1;
+		}
+		break;
+	}
+}
+
+/*
+ * capopen - Set up a capture for a job about to be launched and return
+ *     the write end of its pipe, or -1 if capture is off or fails.  The
+ *     capture is attached to the job's PID and job ID by capattach.
+ */
+	int 
+capopen(void)
+{
+	struct capture_t *cap = NULL;
+	int i, pfd[2];
+
+	if (!capture)
+		return -1;
+	/* Use a free slot, or else the one of the oldest finished job */
+	for (i = 0; i < MAXJOBS; i++) {
+		if (captures[i].ring == NULL) {
+			cap = &captures[i];
+			break;
+		}
+		if (captures[i].done && (cap == NULL || captures[i].seq < cap->seq))
+			cap = &captures[i];
+	}
+	if (cap == NULL)
+		return -1;
+	freecap(cap);
+
+	if ((cap->memfd = memfd_create("tsh-capture", MFD_CLOEXEC)) < 0 ||
+			ftruncate(cap->memfd, capsize) < 0 ||
+			(cap->ring = mmap(NULL, capsize, PROT_READ|PROT_WRITE,
+							  MAP_SHARED, cap->memfd, 0)) == MAP_FAILED ||
+			pipe2(pfd, O_CLOEXEC) < 0) {
+		if (cap->ring == MAP_FAILED)
+			cap->ring = NULL;
+		freecap(cap);
+		return -1;
+	}
+	cap->size = capsize;
+	cap->rfd = pfd[0];
+	fcntl(cap->rfd, F_SETOWN, getpid());
+	fcntl(cap->rfd, F_SETFL, O_NONBLOCK|O_ASYNC);
+	pending = cap;
+	return pfd[1];
+}
+
+/*
+ * capattach - Attach the capture opened by capopen to the job just
+ *     spawned with pid and close the parent's copy of the write end.
+ */
+	void 
+capattach(pid_t pid, int wfd)
+{
+	struct capture_t *cap = pending;
+	static unsigned long seq;
+	struct job_t *job;
+
+	if (wfd < 0)
+		return;
+	close(wfd);
+	pending = NULL;
+	if ((job = getjobpid(job_list, pid)) == NULL) {
+		freecap(cap);
+		return;
+	}
+	/* A new job with this ID replaces the output of the old one */
+	while (findcap(job->jid) != NULL)
+		freecap(findcap(job->jid));
+	cap->jid = job->jid;
+	cap->pid = pid;
+	cap->seq = ++seq;
+	strcpy(cap->cmdline, job->cmdline);
+}
+
+/* capdone - Called by sigchld_handler when the job with pid terminates */
+	void 
+capdone(pid_t pid)
+{
+	sigset_t mask, oldmask;
+	int i;
+
+	/* The SIGIO handler must not drain the same pipe under us */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGIO);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	for (i = 0; i < MAXJOBS; i++)
+		if (captures[i].ring != NULL && captures[i].pid == pid) {
+			capdrain(&captures[i]);
+			captures[i].done = 1;
+		}
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+/* capwrite - Write the last nbytes of a capture to fd */
+	static void 
+capwrite(struct capture_t *cap, size_t nbytes, int fd)
+{
+	size_t start, first;
+
+	if (nbytes > cap->len)
+		nbytes = cap->len;
+	start = (cap->head + cap->len - nbytes) % cap->size;
+	first = cap->size - start < nbytes ? cap->size - start : nbytes;
+	if (write(fd, cap->ring + start, first) < 0 ||
+			write(fd, cap->ring, nbytes - first) < 0)
+		fprintf(stderr, "Error writing to output file\n");
+}
+
+/* taillen - Number of bytes at the end of a capture holding its last n lines */
+	static size_t 
+taillen(struct capture_t *cap, int n)
+{
+	size_t i;
+
+	for (i = 0; i < cap->len; i++) {
+		/* A final newline does not start another line */
+		if (cap->ring[(cap->head + cap->len - 1 - i) % cap->size] == '\n' &&
+				i > 0 && --n == 0)
+			return i;
+	}
+	return cap->len;
+}
+
+/*
+ * capcmd - The jobs -o, tail and dump builtins.  argv[jidarg] is the job
+ *     (%N).  jobs -o and dump write the whole capture, tail its last lines
+ *     (-n K, 10 by default).  A job whose output goes to a log is read
+ *     from the log instead.
+ */
+	void 
+capcmd(struct cmdline_tokens *tok, int jidarg)
+{
+	struct capture_t *cap;
+	struct joblog_t *log;
+	sigset_t mask, oldmask;
+	char *spec = tok->argv[jidarg];
+	int lines = 0;
+
+	if (spec == NULL || *spec != '%') {
+		printf("%s: usage: %s %%N\n", tok->argv[0], tok->argv[0]);
+		return;
+	}
+	if (tok->builtins == BUILTIN_TAIL) {
+		lines = 10;
+		if (tok->argc > jidarg + 2 && !strcmp(tok->argv[jidarg + 1], "-n"))
+			lines = atoi(tok->argv[jidarg + 2]);
+	}
+
+	if ((log = findlog(atoi(spec + 1))) != NULL) {
+		fflush(stdout);
+		logwrite(log, lines, STDOUT_FILENO);
+		return;
+	}
+
+	/* Keep the SIGIO handler off the ring while it is copied out */
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGIO);
+	Sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	if ((cap = findcap(atoi(spec + 1))) == NULL) {
+		printf("%s: No captured output\n", spec);
+	} else {
+		fflush(stdout);
+		capwrite(cap, lines ? taillen(cap, lines) : cap->len, STDOUT_FILENO);
+		if (cap->total > cap->len && !lines)
+			fprintf(stderr, "[%s: %zu earlier bytes dropped]\n", spec,
+					cap->total - cap->len);
+	}
+	Sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+/*
+ * capturecmd - The capture builtin: "capture on", "capture off" or
+ *     "capture size=BYTES"; without arguments it prints the settings.
+ */
+	void 
+capturecmd(struct cmdline_tokens *tok)
+{
+	long size;
+	int i;
+
+	for (i = 1; i < tok->argc; i++) {
+		if (!strcmp(tok->argv[i], "on"))
+			capture = 1;
+		else if (!strcmp(tok->argv[i], "off"))
+			capture = 0;
+		else if (!strncmp(tok->argv[i], "size=", 5) &&
+				(size = atol(tok->argv[i] + 5)) > 0)
+			capsize = size;
+		else {
+			printf("capture: usage: capture [on|off] [size=BYTES]\n");
+			return;
+		}
+	}
+	if (tok->argc == 1)
+		printf("capture %s size=%zu\n", capture ? "on" : "off", capsize);
+}
+
+/*****************
+ * Job logs
+ *****************/
+
+/*
+ * "command > log:PREFIX" sends the command's output to a pipe the shell
+ * owns instead of to a file.  A thread of the shell (logthread) reads
+ * the pipes of all logs, cuts the output into blocks of 64 KiB,
+ * compresses each with the bundled LZ4 codec (tsh_lz4.h) and appends it
+ * to the segment PREFIX.N.lz4 being written.  A segment is a complete
+ * LZ4 frame, so "lz4 -dc PREFIX.*.lz4" (in order of N) reads a log back
+ * where lz4 is installed.  A segment is closed and the next one begun
+ * once it holds logcfg.size bytes or has been open logcfg.time ms, and
+ * with logcfg.keep only that many segments are kept, oldest removed
+ * first.  A partial block is written out when it is LOGFLUSH ms old, so
+ * a quiet job's output still reaches the disk.
+ *
+ * Every block written is recorded, in memory and as a line
+ *
+ *     segment offset rawoffset rawlength length
+ *
+ * of PREFIX.idx, so tail %N decompresses just the last few blocks.
+ * Logs outlive their jobs until their slot is needed again, and logs
+ * reports how much each one took in and wrote out.
+ *
+ * The thread and the shell share joblogs under loglock, which guards
+ * the bookkeeping only: counters, the index of blocks and which logs
+ * are open.  Whoever reads a log's pipe or writes its files (the thread,
+ * or tail catching up with a job) first claims the log with logclaim,
+ * then reads, compresses and writes without the lock and takes it again
+ * just to record what it did.  So the lock is never held while
+ * compressing or waiting for the disk, and a fork, which takes it,
+ * never waits for either.  The thread takes no signals.
+ */
+
+/* logpath - The name of segment seg of l, or of its index if seg < 0 */
+	static char *
+logpath(const char *prefix, int seg, char *path, size_t size)
+{
+	if (seg < 0)
+		snprintf(path, size, "%s.idx", prefix);
+	else
+		snprintf(path, size, "%s.%d.lz4", prefix, seg);
+	return path;
+}
+
+/*
+ * logclaim, logrelease - Take l for reading its pipe or writing its
+ *     files, after whoever has it now is done, and give it back.  Both
+ *     are called with loglock held; the work between them is done
+ *     without it.
+ */
+	static void 
+logclaim(struct joblog_t *l)
+{
+	while (l->busy)
+		pthread_cond_wait(&logidle, &loglock);
+	l->busy = 1;
+}
+
+	static void 
+logrelease(struct joblog_t *l)
+{
+	l->busy = 0;
+	pthread_cond_broadcast(&logidle);
+}
+
+/* logtally - Count bytes written to disk and failed writes of l */
+	static void 
+logtally(struct joblog_t *l, long long out, int errors)
+{
+	pthread_mutex_lock(&loglock);
+	l->out += out;
+	l->errors += errors;
+	pthread_mutex_unlock(&loglock);
+}
+
+/* logsegopen - Start segment l->seg, dropping the ones beyond logcfg.keep */
+	static int 
+logsegopen(struct joblog_t *l)
+{
+	char path[MAXLINE];
+	uint8_t hdr[TSHLZ4_HDRLEN];
+
+	l->segfd = open(logpath(l->prefix, l->seg, path, sizeof(path)),
+			O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (l->segfd < 0)
+		return -1;
+	tshlz4_header(hdr);
+	logtally(l, sizeof(hdr),
+			write(l->segfd, hdr, sizeof(hdr)) != sizeof(hdr));
+	l->segoff = sizeof(hdr);
+	l->segstart = now_ms();
+	while (logcfg.keep > 0 && l->seg - l->firstseg >= logcfg.keep) {
+		unlink(logpath(l->prefix, l->firstseg, path, sizeof(path)));
+		pthread_mutex_lock(&loglock);
+		l->firstseg++;
+		pthread_mutex_unlock(&loglock);
+	}
+	return 0;
+}
+
+/* logsegclose - End the frame of the current segment and close it */
+	static void 
+logsegclose(struct joblog_t *l)
+{
+	static const uint8_t endmark[4];
+
+	if (l->segfd < 0)
+		return;
+	logtally(l, sizeof(endmark),
+			write(l->segfd, endmark, sizeof(endmark)) != sizeof(endmark));
+	close(l->segfd);
+	l->segfd = -1;
+}
+
+/* logrotate - Close the current segment of l and start the next one */
+	static void 
+logrotate(struct joblog_t *l)
+{
+	logsegclose(l);
+	pthread_mutex_lock(&loglock);
+	l->seg++;
+	pthread_mutex_unlock(&loglock);
+	if (logsegopen(l) < 0)
+		logtally(l, 0, 1);
+}
+
+/*
+ * logflush - Compress the block being filled and append it to the
+ *     segment, starting a new segment if that one is full.  Only the
+ *     new entry of the index is added under loglock.
+ */
+	static void 
+logflush(struct joblog_t *l)
+{
+	/* On the stack: the thread and tail may flush two logs at once */
+	uint8_t zbuf[4 + TSHLZ4_BOUND(TSHLZ4_BLOCK)];
+	struct logblock_t *b, entry;
+	struct timespec t0, t1;
+	size_t len;
+	int ok, indexed = 0;
+
+	if (l->buflen == 0 || l->segfd < 0)
+		return;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+	len = tshlz4_compress(l->buf, l->buflen, zbuf + 4);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+	if (len >= l->buflen) {
+		/* Incompressible: store it as it is */
+		len = l->buflen;
+		memcpy(zbuf + 4, l->buf, len);
+		tshlz4_le32(zbuf, len | TSHLZ4_STORED);
+	} else
+		tshlz4_le32(zbuf, len);
+	entry.seg = l->seg;
+	entry.off = l->segoff;
+	entry.raw = l->in - l->buflen;
+	entry.rawlen = l->buflen;
+	entry.len = len;
+	l->buflen = 0;
+	ok = write(l->segfd, zbuf, 4 + len) == (ssize_t) (4 + len);
+
+	pthread_mutex_lock(&loglock);
+	l->zns += (t1.tv_sec - t0.tv_sec) * 1000000000LL + t1.tv_nsec - t0.tv_nsec;
+	if (!ok)
+		l->errors++;
+	else {
+		l->out += 4 + len;
+		if (l->nblocks == l->maxblocks) {
+			l->maxblocks = l->maxblocks ? 2 * l->maxblocks : 256;
+			if ((b = realloc(l->blocks, l->maxblocks * sizeof(*b))) == NULL) {
+				/* tail will just not see this far */
+				l->maxblocks = l->nblocks;
+				l->errors++;
+			} else
+				l->blocks = b;
+		}
+		if (l->nblocks < l->maxblocks) {
+			l->blocks[l->nblocks++] = entry;
+			indexed = 1;
+		}
+	}
+	pthread_mutex_unlock(&loglock);
+	if (!ok)
+		return;
+
+	if (indexed && l->idxfd >= 0 && dprintf(l->idxfd, "%d %lld %lld %u %u\n",
+				entry.seg, (long long) entry.off, entry.raw, entry.rawlen,
+				entry.len) < 0)
+		logtally(l, 0, 1);
+	l->segoff += 4 + len;
+	if (l->segoff >= logcfg.size)
+		logrotate(l);
+}
+
+/* logeof - All writers of l are gone: write out the rest and close it */
+	static void 
+logeof(struct joblog_t *l)
+{
+	logflush(l);
+	logsegclose(l);
+	if (l->idxfd >= 0)
+		close(l->idxfd);
+	close(l->rfd);
+	l->idxfd = -1;
+	pthread_mutex_lock(&loglock);
+	l->rfd = -1;
+	l->end = now_ms();
+	pthread_mutex_unlock(&loglock);
+}
+
+/*
+ * logread - Move what is ready in l's pipe into its block.  Returns the
+ *     bytes moved, 0 at EOF, -1 if there was nothing to read.
+ */
+	static ssize_t 
+logread(struct joblog_t *l)
+{
+	ssize_t n;
+
+	n = read(l->rfd, l->buf + l->buflen, TSHLZ4_BLOCK - l->buflen);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return -1;
+	if (n <= 0) {
+		logeof(l);
+		return 0;
+	}
+	if (l->buflen == 0)
+		l->bufsince = now_ms();
+	l->buflen += n;
+	pthread_mutex_lock(&loglock);
+	l->in += n;
+	pthread_mutex_unlock(&loglock);
+	if (l->buflen == TSHLZ4_BLOCK)
+		logflush(l);
+	return n;
+}
+
+/* logthread - Compress the output of all logs as it comes */
+	static void *
+logthread(void *arg)
+{
+	struct pollfd pfd[MAXLOGS + 1];
+	struct joblog_t *who[MAXLOGS + 1], *l;
+	char junk[64];
+	long long now;
+	int i, n, busy;
+
+	while (1) {
+		pfd[0].fd = logwake[0];
+		pfd[0].events = POLLIN;
+		n = 1;
+		pthread_mutex_lock(&loglock);
+		for (i = 0; i < MAXLOGS; i++)
+			if (joblogs[i].prefix != NULL && joblogs[i].rfd >= 0) {
+				pfd[n].fd = joblogs[i].rfd;
+				pfd[n].events = POLLIN;
+				who[n++] = &joblogs[i];
+			}
+		pthread_mutex_unlock(&loglock);
+
+		/* Without logs to write there is nothing to flush or rotate */
+		if (poll(pfd, n, n > 1 ? LOGFLUSH / 4 : -1) < 0)
+			continue;
+		if (pfd[0].revents)
+			while (read(logwake[0], junk, sizeof(junk)) > 0)
+				;
+
+		now = now_ms();
+		for (i = 1; i < n; i++) {
+			l = who[i];
+			pthread_mutex_lock(&loglock);
+			logclaim(l);
+			/* tail may have read it to EOF in the meantime */
+			if (l->rfd != pfd[i].fd) {
+				logrelease(l);
+				pthread_mutex_unlock(&loglock);
+				continue;
+			}
+			pthread_mutex_unlock(&loglock);
+
+			if (pfd[i].revents)
+				logread(l);
+			busy = l->buflen > 0;
+			if (l->rfd >= 0 && busy && now - l->bufsince >= LOGFLUSH)
+				logflush(l);
+			if (l->rfd >= 0 && logcfg.time &&
+					now - l->segstart >= logcfg.time &&
+					(busy || l->segoff > TSHLZ4_HDRLEN)) {
+				logflush(l);
+				logrotate(l);
+			}
+
+			pthread_mutex_lock(&loglock);
+			logrelease(l);
+			pthread_mutex_unlock(&loglock);
+		}
+	}
+	return NULL;
+}
+
+/* freelog - Release the memory and descriptors of a log */
+	static void 
+freelog(struct joblog_t *l)
+{
+	if (l->rfd >= 0)
+		close(l->rfd);
+	if (l->segfd >= 0)
+		close(l->segfd);
+	if (l->idxfd >= 0)
+		close(l->idxfd);
+	free(l->prefix);
+	free(l->buf);
+	free(l->blocks);
+	memset(l, 0, sizeof(*l));
+	l->rfd = l->segfd = l->idxfd = -1;
+}
+
+/*
+ * logforkprepare, logforkparent, logforkchild - loglock is held across
+ *     fork(2), so that a forked copy of the shell never inherits it
+ *     taken.  Nobody holds it for long, so a fork never waits for the
+ *     disk.  The copy has no logthread and forgets the shell's logs.
+ */
+	static void 
+logforkprepare(void)
+{
+	pthread_mutex_lock(&loglock);
+}
+
+	static void 
+logforkparent(void)
+{
+	pthread_mutex_unlock(&loglock);
+}
+
+	static void 
+logforkchild(void)
+{
+	int i;
+
+	for (i = 0; i < MAXLOGS; i++)
+		if (joblogs[i].prefix != NULL)
+			freelog(&joblogs[i]);
+	close(logwake[0]);
+	close(logwake[1]);
+	logwake[0] = logwake[1] = -1;
+	logrunning = 0;
+	pthread_mutex_init(&loglock, NULL);
+	pthread_cond_init(&logidle, NULL);
+}
+
+/*
+ * logfinish - At exit, write out what the logs have been sent so far.
+ *     Jobs still running lose what they write from now on.
+ */
+	static void 
+logfinish(void)
+{
+	struct joblog_t *l;
+	int i;
+
+	for (i = 0; i < MAXLOGS; i++) {
+		l = &joblogs[i];
+		pthread_mutex_lock(&loglock);
+		if (l->prefix == NULL || l->rfd < 0) {
+			pthread_mutex_unlock(&loglock);
+			continue;
+		}
+		logclaim(l);                   /* and keep logthread off it */
+		pthread_mutex_unlock(&loglock);
+		if (l->rfd < 0)
+			continue;
+		fcntl(l->rfd, F_SETFL, O_NONBLOCK);
+		while (logread(l) > 0)
+			;
+		if (l->rfd >= 0) {
+			logflush(l);
+			logsegclose(l);
+		}
+	}
+}
+
+/* logstart - Start logthread, once per process */
+	static int 
+logstart(void)
+{
+	static int registered;
+	sigset_t all, old;
+	pthread_t tid;
+	int err;
+
+	if (pipe2(logwake, O_CLOEXEC|O_NONBLOCK) < 0)
+		return -1;
+	/* The thread is to take no signals: it inherits this mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&tid, NULL, logthread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		close(logwake[0]);
+		close(logwake[1]);
+		logwake[0] = logwake[1] = -1;
+		errno = err;
+		return -1;
+	}
+	pthread_detach(tid);
+	if (!registered) {
+		pthread_atfork(logforkprepare, logforkparent, logforkchild);
+		atexit(logfinish);
+		registered = 1;
+	}
+	logrunning = 1;
+	return 0;
+}
+
+/*
+ * logopen - Open the log PREFIX for a job about to be forked.  Returns
+ *     its slot, with *wfd set to the write end of its pipe, or -1 (with
+ *     *wfd -1) after saying why it cannot be written.
+ */
+	int 
+logopen(const char *prefix, int *wfd)
+{
+	static unsigned long seq;
+	struct joblog_t *l = NULL;
+	char path[MAXLINE];
+	int i, pfd[2];
+
+	*wfd = -1;
+	if (!logrunning && logstart() < 0) {
+		fprintf(stderr, "log:%s: %s\n", prefix, strerror(errno));
+		return -1;
+	}
+	pthread_mutex_lock(&loglock);
+	/* Use a free slot, or else the one of the oldest finished log */
+	for (i = 0; i < MAXLOGS; i++) {
+		if (joblogs[i].prefix == NULL) {
+			l = &joblogs[i];
+			break;
+		}
+		if (joblogs[i].rfd >= 0 && !strcmp(joblogs[i].prefix, prefix)) {
+			pthread_mutex_unlock(&loglock);
+			fprintf(stderr, "log:%s: already being written\n", prefix);
+			return -1;
+		}
+		if (joblogs[i].rfd < 0 && (l == NULL || joblogs[i].seq < l->seq))
+			l = &joblogs[i];
+	}
+	if (l == NULL) {
+		pthread_mutex_unlock(&loglock);
+		fprintf(stderr, "log:%s: too many logs being written\n", prefix);
+		return -1;
+	}
+	logclaim(l);
+	freelog(l);
+	l->busy = 1;
+	l->prefix = strdup(prefix);
+	l->seq = ++seq;
+	l->start = now_ms();
+	pthread_mutex_unlock(&loglock);
+
+	/* Its files are created without loglock; logthread leaves a log
+	 * alone until it has a pipe */
+	if (l->prefix == NULL || (l->buf = malloc(TSHLZ4_BLOCK)) == NULL ||
+			(l->idxfd = open(logpath(prefix, -1, path, sizeof(path)),
+							 O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0 ||
+			logsegopen(l) < 0 || pipe2(pfd, O_CLOEXEC) < 0) {
+		fprintf(stderr, "log:%s: %s\n", prefix, strerror(errno));
+		pthread_mutex_lock(&loglock);
+		freelog(l);
+		logrelease(l);
+		pthread_mutex_unlock(&loglock);
+		return -1;
+	}
+	fcntl(pfd[0], F_SETPIPE_SZ, LOGPIPE);
+	pthread_mutex_lock(&loglock);
+	l->rfd = pfd[0];
+	logrelease(l);
+	pthread_mutex_unlock(&loglock);
+
+	if (write(logwake[1], "", 1) < 0 && errno != EAGAIN)
+		unix_error("log wakeup error");
+	*wfd = pfd[1];
+	return l - joblogs;
+}
+
+/* logattach - The job pid has been forked with the write end wfd of a log */
+	void 
+logattach(int slot, pid_t pid, int wfd)
+{
+	if (wfd < 0)
+		return;
+	close(wfd);
+	pthread_mutex_lock(&loglock);
+	joblogs[slot].pid = pid;
+	joblogs[slot].jid = pid2jid(pid);
+	pthread_mutex_unlock(&loglock);
+}
+
+/* findlog - The newest log of job jid, NULL if there is none */
+	struct joblog_t *
+findlog(int jid)
+{
+	struct joblog_t *l = NULL;
+	struct job_t *job = getjobjid(job_list, jid);
+	int i;
+
+	for (i = 0; i < MAXLOGS; i++) {
+		if (joblogs[i].prefix == NULL || joblogs[i].jid != jid)
+			continue;
+		/* Not if the job ID now belongs to another job */
+		if (job != NULL && job->pid != joblogs[i].pid)
+			continue;
+		if (l == NULL || joblogs[i].seq > l->seq)
+			l = &joblogs[i];
+	}
+	return l;
+}
+
+/*
+ * logblock - Read block k of l into raw.  Returns its length, or -1 if
+ *     its segment has been removed or it cannot be read back.  *segfd is
+ *     the open segment *seg, kept from one call to the next.
+ */
+	static long 
+logblock(struct joblog_t *l, int k, int *segfd, int *seg, uint8_t *zbuf,
+		uint8_t *raw)
+{
+	struct logblock_t b;
+	char path[MAXLINE];
+	uint32_t size;
+
+	pthread_mutex_lock(&loglock);      /* blocks may be moved by realloc */
+	b = l->blocks[k];
+	pthread_mutex_unlock(&loglock);
+	if (b.seg != *seg) {
+		if (*segfd >= 0)
+			close(*segfd);
+		*seg = b.seg;
+		*segfd = open(logpath(l->prefix, b.seg, path, sizeof(path)),
+				O_RDONLY|O_CLOEXEC);
+	}
+	if (*segfd < 0 || pread(*segfd, zbuf, 4 + b.len, b.off) != 4 + b.len)
+		return -1;
+	size = zbuf[0] | zbuf[1] << 8 | zbuf[2] << 16 | (uint32_t) zbuf[3] << 24;
+	if ((size & ~TSHLZ4_STORED) != b.len)
+		return -1;
+	if (size & TSHLZ4_STORED) {
+		memcpy(raw, zbuf + 4, b.len);
+		return b.len;
+	}
+	if (tshlz4_decompress(zbuf + 4, b.len, raw, TSHLZ4_BLOCK) != b.rawlen)
+		return -1;
+	return b.rawlen;
+}
+
+/*
+ * logwrite - Write the last lines lines of the output in l to fd, or
+ *     all of it if lines is 0.  Only the blocks holding those lines are
+ *     read back and decompressed.
+ */
+	void 
+logwrite(struct joblog_t *l, int lines, int fd)
+{
+	uint8_t *zbuf, *raw, *pend, *text = NULL, *t, *src;
+	size_t plen, len = 0, cap = 0, start;
+	struct pollfd pfd;
+	long got, lost = 0, taken = 0;
+	int k, nblocks, seg = -1, segfd = -1, n = 0;
+
+	zbuf = malloc(4 + TSHLZ4_BOUND(TSHLZ4_BLOCK));
+	raw = malloc(TSHLZ4_BLOCK);
+	pend = malloc(TSHLZ4_BLOCK);
+	if (zbuf == NULL || raw == NULL || pend == NULL) {
+		fprintf(stderr, "log:%s: out of memory\n", l->prefix);
+		goto out;
+	}
+	/* Take in what the job has written so far (at most a pipe full, so
+	 * that a chatty job cannot keep us here), then what is still in the
+	 * block being filled comes last */
+	pthread_mutex_lock(&loglock);
+	logclaim(l);
+	pthread_mutex_unlock(&loglock);
+	pfd.events = POLLIN;
+	while ((pfd.fd = l->rfd) >= 0 && taken < LOGPIPE &&
+			poll(&pfd, 1, 0) > 0 && (got = logread(l)) > 0)
+		taken += got;
+	plen = l->buflen;
+	memcpy(pend, l->buf, plen);
+	pthread_mutex_lock(&loglock);
+	nblocks = l->nblocks;
+	logrelease(l);
+	pthread_mutex_unlock(&loglock);
+
+	if (lines == 0) {
+		for (k = 0; k < nblocks; k++) {
+			if ((got = logblock(l, k, &segfd, &seg, zbuf, raw)) < 0)
+				lost++;
+			else if (write(fd, raw, got) < 0)
+				break;
+		}
+		if (write(fd, pend, plen) < 0)
+			fprintf(stderr, "Error writing to output file\n");
+		if (lost > 0)
+			fprintf(stderr, "[%%%d: %ld blocks in removed segments]\n",
+					l->jid, lost);
+		goto out;
+	}
+
+	/* Gather blocks from the end, in text growing downwards, until they
+	 * hold enough lines */
+	for (k = nblocks; ; k--) {
+		if (k == nblocks)
+			src = pend, got = plen;
+		else if (k < 0 || (got = logblock(l, k, &segfd, &seg, zbuf, raw)) < 0)
+			break;
+		else
+			src = raw;
+		if (got == 0)
+			continue;
+		if (len + got > cap) {
+			if ((t = malloc(2 * (len + got))) == NULL)
+				break;
+			if (text != NULL)
+				memcpy(t + 2 * (len + got) - len, text + cap - len, len);
+			free(text);
+			text = t;
+			cap = 2 * (len + got);
+		}
+		memcpy(text + cap - len - got, src, got);
+		len += got;
+		while (got-- > 0)
+			n += src[got] == '\n';
+		/* A final newline does not start another line */
+		if (len > 0 && n - (text[cap - 1] == '\n') >= lines)
+			break;
+	}
+	if (len > 0) {
+		t = text + cap - len;
+		for (start = 0, n = lines; start < len; start++)
+			if (t[len - 1 - start] == '\n' && start > 0 && --n == 0)
+				break;
+		if (write(fd, t + len - start, start) < 0)
+			fprintf(stderr, "Error writing to output file\n");
+	}
+out:
+	if (segfd >= 0)
+		close(segfd);
+	free(text);
+	free(zbuf);
+	free(raw);
+	free(pend);
+}
+
+/*
+ * logscmd - The logs builtin: lists the job logs, with what each took in
+ *     and wrote out.  "logs size=BYTES time=DURATION keep=N" sets the
+ *     rotation of new segments (BYTES may end in K, M or G; time=0 and
+ *     keep=0 for no limit).
+ */
+	void 
+logscmd(struct cmdline_tokens *tok)
+{
+	struct joblog_t *l, *order[MAXLOGS], *t;
+	long long size, now = now_ms();
+	double secs;
+	char *val, *end;
+	long ms;
+	int i, j, n = 0;
+
+	for (i = 1; i < tok->argc; i++) {
+		if ((val = strchr(tok->argv[i], '=')) == NULL)
+			goto usage;
+		*val++ = '\0';
+		if (!strcmp(tok->argv[i], "size")) {
+			size = strtoll(val, &end, 10);
+			if (*end == 'K' || *end == 'k')
+				size <<= 10, end++;
+			else if (*end == 'M' || *end == 'm')
+				size <<= 20, end++;
+			else if (*end == 'G' || *end == 'g')
+				size <<= 30, end++;
+			if (end == val || *end != '\0' || size <= TSHLZ4_HDRLEN)
+				goto usage;
+			logcfg.size = size;
+		} else if (!strcmp(tok->argv[i], "time")) {
+			if ((ms = parsetime(val)) < 0)
+				goto usage;
+			logcfg.time = ms;
+		} else if (!strcmp(tok->argv[i], "keep")) {
+			if ((logcfg.keep = atoi(val)) < 0)
+				logcfg.keep = 0;
+		} else
+			goto usage;
+	}
+	if (tok->argc > 1)
+		return;
+
+	printf("size=%lld time=%ldms keep=%d\n", logcfg.size, logcfg.time,
+			logcfg.keep);
+	pthread_mutex_lock(&loglock);
+	for (i = 0; i < MAXLOGS; i++)
+		if (joblogs[i].prefix != NULL)
+			order[n++] = &joblogs[i];
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && order[j]->seq < order[j-1]->seq; j--) {
+			t = order[j];
+			order[j] = order[j-1];
+			order[j-1] = t;
+		}
+	for (i = 0; i < n; i++) {
+		l = order[i];
+		secs = ((l->rfd >= 0 ? now : l->end) - l->start) / 1e3;
+		printf("[%d] (%d) %s: %d segment%s, %.1f MB in, %.1f MB out, "
+				"ratio %.2f, %.1f MB/s, compressor %.0f MB/s, %s",
+				l->jid, l->pid, l->prefix, l->seg - l->firstseg + 1,
+				l->seg == l->firstseg ? "" : "s", l->in / 1048576.0,
+				l->out / 1048576.0, l->out ? (double) l->in / l->out : 0,
+				secs > 0 ? l->in / 1048576.0 / secs : 0,
+				l->zns ? l->in / 1048576.0 / (l->zns / 1e9) : 0,
+				l->rfd >= 0 ? "writing" : "done");
+		if (l->errors)
+			printf(", %d write errors", l->errors);
+		printf("\n");
+	}
+	pthread_mutex_unlock(&loglock);
+	return;
+
+usage:
+	printf("logs: usage: logs [size=BYTES] [time=DURATION] [keep=N]\n");
+}
+
+/* logsummary - The logs line of the stats builtin */
+	void 
+logsummary(void)
+{
+	long long in = 0, out = 0;
+	int i, writing = 0;
+
+	pthread_mutex_lock(&loglock);
+	for (i = 0; i < MAXLOGS; i++)
+		if (joblogs[i].prefix != NULL) {
+			in += joblogs[i].in;
+			out += joblogs[i].out;
+			writing += joblogs[i].rfd >= 0;
+		}
+	pthread_mutex_unlock(&loglock);
+	printf("logs:      %d writing, %.1f MB in, %.1f MB out (ratio %.2f)\n",
+			writing, in / 1048576.0, out / 1048576.0,
+			out ? (double) in / out : 0);
+}
+
+/*****************
+ * Job timeouts
+ *****************/
+
+/*
+ * Job deadlines live in a hierarchical timer wheel of WHEEL_LEVELS
+ * levels of WHEEL_SIZE slots.  Level 0 has one slot per TICK_MS tick;
+ * each slot of level L covers WHEEL_SIZE^L ticks and is cascaded down
+ * into the finer levels when the wheel reaches it, so adding, cancelling
+ * and expiring a deadline are all O(1) no matter how many there are.
+ * The whole wheel is driven by one interval timer (SIGALRM), which is
+ * only armed while the wheel holds deadlines.  When a job's deadline
+ * passes it gets SIGTERM, and SIGKILL killgrace ms later if it is still
+ * around.  Outside the SIGALRM handler the wheel is only touched with
+ * SIGALRM blocked.
+ */
+
+/* tick_now - Ticks since the wheel was started */
+	static long long 
+tick_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+/* blockalrm - Block (how = SIG_BLOCK) or restore SIGALRM and SIGCHLD */
+	static void 
+blockalrm(int how, sigset_t *oldmask)
+{
+	sigset_t mask;
+
+	if (how == SIG_BLOCK) {
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGALRM);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &mask, oldmask);
+	} else
+		sigprocmask(SIG_SETMASK, oldmask, NULL);
+}
+
+/* wheel_link - Put a deadline into the slot its expiry time belongs to */
+	static void 
+wheel_link(struct deadline_t *d)
+{
+	long long delta, slot;
+	int level, shift;
+
+	if (d->expires <= wheel_now)
+		d->expires = wheel_now + 1;
+	delta = d->expires - wheel_now;
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < 1LL << (WHEEL_BITS * (level + 1)))
+			break;
+	/* Deadlines beyond the last level wait in its farthest slot, and are
+	 * linked again (keeping their expiry) when the wheel reaches it */
+	slot = d->expires;
+	if (level == WHEEL_LEVELS - 1 && 
+			delta >= 1LL << (WHEEL_BITS * WHEEL_LEVELS))
+		slot = wheel_now + (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	shift = WHEEL_BITS * level;
+	d->pprev = &wheel[level][(slot >> shift) & (WHEEL_SIZE - 1)];
+	if ((d->next = *d->pprev) != NULL)
+		d->next->pprev = &d->next;
+	*d->pprev = d;
+}
+
+/* wheel_unlink - Take a deadline out of its slot */
+	static void 
+wheel_unlink(struct deadline_t *d)
+{
+	if ((*d->pprev = d->next) != NULL)
+		d->next->pprev = d->pprev;
+	d->next = NULL;
+	d->pprev = NULL;
+}
+
+/* wheel_free - Return a deadline to the free list */
+	static void 
+wheel_free(struct deadline_t *d)
+{
+	d->next = freedeadlines;
+	freedeadlines = d;
+	if (--wheel_count == 0) {
+		struct itimerval it = { { 0, 0 }, { 0, 0 } };
+		setitimer(ITIMER_REAL, &it, NULL);
+	}
+}
+
+/* expire - A deadline has passed: escalate from SIGTERM to SIGKILL */
+	static void 
+expire(struct deadline_t *d)
+{
+	struct job_t *job = getjobpid(job_list, d->pid);
+
+	if (job == NULL) {
+		wheel_free(d);
+		return;
+	}
+	if (!job->timedout) {
+		job->timedout = 1;
+		shmpub(job);
+		/* Commands of a background list do not lead a process group */
+		if (kill(-d->pid, SIGTERM) < 0)
+			kill(d->pid, SIGTERM);
+		/* A stopped job could not act on the SIGTERM */
+		kill(-d->pid, SIGCONT);
+		timeoutstats.timedout++;
+		d->expires = wheel_now + (killgrace + TICK_MS - 1) / TICK_MS;
+		wheel_link(d);
+		return;
+	}
+	if (kill(-d->pid, SIGKILL) < 0)
+		kill(d->pid, SIGKILL);
+	timeoutstats.killed++;
+	job->deadline = NULL;
+	wheel_free(d);
+}
+
+/* wheel_tick - Advance the wheel by one tick */
+	static void 
+wheel_tick(void)
+{
+	struct deadline_t *d, *next;
+	int level, shift;
+
+	wheel_now++;
+	/* Cascade the coarser slots the wheel has just reached */
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		shift = WHEEL_BITS * level;
+		if (wheel_now & ((1LL << shift) - 1))
+			break;
+		d = wheel[level][(wheel_now >> shift) & (WHEEL_SIZE - 1)];
+		wheel[level][(wheel_now >> shift) & (WHEEL_SIZE - 1)] = NULL;
+		for (; d != NULL; d = next) {
+			next = d->next;
+			wheel_link(d);
+		}
+	}
+	d = wheel[0][wheel_now & (WHEEL_SIZE - 1)];
+	wheel[0][wheel_now & (WHEEL_SIZE - 1)] = NULL;
+	for (; d != NULL; d = next) {
+		next = d->next;
+		d->next = NULL;
+		d->pprev = NULL;
+		if (d->expires > wheel_now)
+			wheel_link(d);      /* not due yet */
+		else
+			expire(d);
+	}
+}
+
+/*
+ * wheel_reset - Empty the wheel in a forked copy of the shell, whose
+ *     jobs (and interval timer) are not those of the deadlines it holds
+ */
+	void 
+wheel_reset(void)
+{
+	struct deadline_t *d, *next;
+	int level, i;
+
+	for (level = 0; level < WHEEL_LEVELS; level++)
+		for (i = 0; i < WHEEL_SIZE; i++) {
+			for (d = wheel[level][i]; d != NULL; d = next) {
+				next = d->next;
+				d->next = freedeadlines;
+				d->pprev = NULL;
+				freedeadlines = d;
+			}
+			wheel[level][i] = NULL;
+		}
+	wheel_count = 0;
+}
+
+/*
+ * settimeout - Give the job with pid ms milliseconds to finish.  Returns
+ *     -1 if no deadline could be allocated.
+ */
+	int 
+settimeout(pid_t pid, long ms)
+{
+	struct itimerval it = { { 0, TICK_MS * 1000 }, { 0, TICK_MS * 1000 } };
+	struct deadline_t *d;
+	struct job_t *job;
+	sigset_t oldmask;
+	int i, rc = 0;
+
+	blockalrm(SIG_BLOCK, &oldmask);
+	if (freedeadlines == NULL) {
+		/* Deadlines are allocated here so the handler never mallocs */
+		if ((d = calloc(DEADLINECHUNK, sizeof(*d))) != NULL)
+			for (i = 0; i < DEADLINECHUNK; i++) {
+				d[i].next = freedeadlines;
+				freedeadlines = &d[i];
+			}
+	}
+	if ((job = getjobpid(job_list, pid)) == NULL ||
+			(d = freedeadlines) == NULL) {
+		rc = -1;
+	} else {
+		freedeadlines = d->next;
+		if (wheel_count++ == 0) {
+			/* An idle wheel skips ahead instead of ticking */
+			wheel_now = tick_now();
+			setitimer(ITIMER_REAL, &it, NULL);
+		}
+		d->pid = pid;
+		d->expires = tick_now() + (ms + TICK_MS - 1) / TICK_MS;
+		wheel_link(d);
+		job->deadline = d;
+		job->timeout = ms;
+		shmpub(job);
+	}
+	blockalrm(SIG_SETMASK, &oldmask);
+	return rc;
+}
+
+/*
+ * untimeout - Cancel the deadline of a job.  Called by sigchld_handler
+ *     when the job terminates.
+ */
+	void 
+untimeout(struct job_t *job)
+{
+	sigset_t oldmask;
+
+	if (job == NULL || job->deadline == NULL)
+		return;
+	blockalrm(SIG_BLOCK, &oldmask);
+	wheel_unlink(job->deadline);
+	wheel_free(job->deadline);
+	job->deadline = NULL;
+	blockalrm(SIG_SETMASK, &oldmask);
+}
+
+/*
+ * parsetime - Parse a duration such as 10, 1.5s, 250ms, 2m or 1h (seconds
+ *     by default) into milliseconds.  Returns -1 if it is malformed.
+ */
+	long 
+parsetime(const char *s)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	if (end == s || v < 0)
+		return -1;
+	if (*end == '\0' || !strcmp(end, "s"))
+		return v * 1000;
+	if (!strcmp(end, "ms"))
+		return v;
+	if (!strcmp(end, "m"))
+		return v * 60000;
+	if (!strcmp(end, "h"))
+		return v * 3600000;
+	return -1;
+}
+
+/*
+ * timeoutcmd - The timeout builtin: "timeout -d DURATION" sets the
+ *     timeout of background jobs (0 for none) and "timeout -k DURATION"
+ *     the grace period between SIGTERM and SIGKILL.  Without arguments
+ *     it prints the settings.  ("timeout DURATION command" is handled by
+ *     parseline.)
+ */
+	void 
+timeoutcmd(struct cmdline_tokens *tok)
+{
+	long ms;
+	int i;
+
+	for (i = 1; i < tok->argc; i += 2) {
+		if (i + 1 >= tok->argc || (ms = parsetime(tok->argv[i + 1])) < 0 ||
+				(strcmp(tok->argv[i], "-d") && strcmp(tok->argv[i], "-k"))) {
+			printf("timeout: usage: timeout [-d DURATION] [-k DURATION]\n");
+			return;
+		}
+		if (tok->argv[i][1] == 'd')
+			bgtimeout = ms;
+		else
+			killgrace = ms;
+	}
+	if (tok->argc == 1)
+		printf("timeout -d %ldms -k %ldms\n", bgtimeout, killgrace);
+}
+
+/*******************
+ * Admission control
+ *******************/
+
+/*
+ * Background launches are admitted only while fewer than
+ * admitcfg.inflight background jobs are running and the PSI "some"
+ * averages of /proc/pressure/{cpu,memory,io} and the load average are
+ * below their thresholds (a threshold of 0 is not checked).  A launch
+ * that is not admitted is retried for up to admitcfg.delay ms and then
+ * held back.  With admitcfg.stop set, running background jobs are also
+ * stopped one at a time while the machine is overloaded, and continued
+ * again (ST -> BG) once it is not.  Pressure is sampled at most every
+ * PSI_INTERVAL ms.
+ */
+
+/* now_ms - Monotonic clock in milliseconds */
+	long long 
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * readavg - Return the number following key in the file at path, or 0
+ *     if the file or the key does not exist.
+ */
+	static double 
+readavg(const char *path, const char *key)
+{
+	char buf[256], *p;
+	int fd;
+	ssize_t n;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	if ((p = strstr(buf, key)) == NULL)
+		return 0;
+	return atof(p + strlen(key));
+}
+
+/* sample - Refresh the pressure readings if they are out of date */
+	static void 
+sample(void)
+{
+	long long now = now_ms();
+
+	if (pressure.when && now - pressure.when < PSI_INTERVAL)
+		return;
+	pressure.cpu = readavg("/proc/pressure/cpu", "some avg10=");
+	pressure.mem = readavg("/proc/pressure/memory", "some avg10=");
+	pressure.io = readavg("/proc/pressure/io", "some avg10=");
+	pressure.load = readavg("/proc/loadavg", "");
+	pressure.when = now;
+}
+
+/* overloaded - Name the first threshold exceeded, NULL if none is */
+	static const char *
+overloaded(void)
+{
+	sample();
+	if (admitcfg.cpu > 0 && pressure.cpu > admitcfg.cpu)
+		return "cpu pressure";
+	if (admitcfg.mem > 0 && pressure.mem > admitcfg.mem)
+		return "memory pressure";
+	if (admitcfg.io > 0 && pressure.io > admitcfg.io)
+		return "io pressure";
+	if (admitcfg.load > 0 && pressure.load > admitcfg.load)
+		return "load average";
+	return NULL;
+}
+
+/* bgrunning - Number of running background jobs */
+	static int 
+bgrunning(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (job_list[i].pid != 0 && job_list[i].state == BG)
+			n++;
+	return n;
+}
+
+/* admitwhy - Why a background job may not be launched now, NULL if it may */
+	static const char *
+admitwhy(void)
+{
+	if (bgrunning() >= admitcfg.inflight)
+		return "too many jobs in flight";
+	return overloaded();
+}
+
+/*
+ * admit - Decide whether a background job may be launched now.  If
+ *     maywait is set a refused launch is retried until admitcfg.delay
+ *     has passed.  Returns 1 if the job may be launched, 0 if it is held
+ *     back.
+ */
+	int 
+admit(int maywait)
+{
+	struct timespec pause = { 0, 10000000 };
+	const char *why;
+	long long deadline = now_ms() + admitcfg.delay;
+	int waited = 0;
+
+	rebalance();
+	while (1) {
+		if ((why = admitwhy()) == NULL) {
+			admitstats.admitted++;
+			if (waited)
+				admitstats.delayed++;
+			return 1;
+		}
+		if (!maywait || now_ms() >= deadline)
+			break;
+		/* SIGCHLD may arrive while we sleep and free a slot */
+		nanosleep(&pause, NULL);
+		waited = 1;
+	}
+	admitstats.held++;
+	printf("Job held back: %s\n", why);
+	return 0;
+}
+
+/*
+ * rebalance - With admitcfg.stop set, stop the newest running background
+ *     job while the machine is overloaded (leaving at least one running),
+ *     and continue the oldest throttled job once it is not.  SIGCHLD is
+ *     blocked throughout, so that the job chosen cannot be reaped (and
+ *     its slot cleared) before it is signalled.
+ */
+	void 
+rebalance(void)
+{
+	struct job_t *job = NULL;
+	sigset_t oldmask;
+	int i, stop;
+
+	blockalrm(SIG_BLOCK, &oldmask);
+	if ((stop = admitcfg.stop && overloaded())) {
+		if (bgrunning() >= 2)
+			for (i = 0; i < MAXJOBS; i++)
+				if (job_list[i].pid != 0 && job_list[i].state == BG &&
+						(job == NULL || job_list[i].jid > job->jid))
+					job = &job_list[i];
+	} else
+		for (i = 0; i < MAXJOBS; i++)
+			if (job_list[i].pid != 0 && job_list[i].throttled &&
+					(job == NULL || job_list[i].jid < job->jid))
+				job = &job_list[i];
+	if (job == NULL || job->pid == 0) {
+		blockalrm(SIG_SETMASK, &oldmask);
+		return;
+	}
+	job->throttled = stop;
+	job->state = stop ? ST : BG;
+	shmpub(job);
+	/* A job that has just exited is reaped once SIGCHLD is let in */
+	if (kill(-(job->pid), stop ? SIGSTOP : SIGCONT) < 0 && errno != ESRCH)
+		unix_error("kill error");
+	if (stop)
+		admitstats.stopped++;
+	else
+		admitstats.resumed++;
+	blockalrm(SIG_SETMASK, &oldmask);
+}
+
+/*
+ * admitcmd - The admit builtin.  Without arguments it prints the current
+ *     settings; otherwise each argument is a key=value pair.
+ */
+	void 
+admitcmd(struct cmdline_tokens *tok)
+{
+	char *val;
+	int i;
+
+	for (i = 1; i < tok->argc; i++) {
+		if ((val = strchr(tok->argv[i], '=')) == NULL) {
+			printf("admit: expected key=value: %s\n", tok->argv[i]);
+			return;
+		}
+		*val++ = '\0';
+		if (!strcmp(tok->argv[i], "inflight"))
+			admitcfg.inflight = atoi(val);
+		else if (!strcmp(tok->argv[i], "cpu"))
+			admitcfg.cpu = atof(val);
+		else if (!strcmp(tok->argv[i], "mem"))
+			admitcfg.mem = atof(val);
+		else if (!strcmp(tok->argv[i], "io"))
+			admitcfg.io = atof(val);
+		else if (!strcmp(tok->argv[i], "load"))
+			admitcfg.load = atof(val);
+		else if (!strcmp(tok->argv[i], "delay"))
+			admitcfg.delay = atoi(val);
+		else if (!strcmp(tok->argv[i], "stop"))
+			admitcfg.stop = !strcmp(val, "on") || !strcmp(val, "1");
+		else {
+			printf("admit: unknown setting: %s\n", tok->argv[i]);
+			return;
+		}
+	}
+	if (tok->argc == 1)
+		printf("inflight=%d cpu=%.2f mem=%.2f io=%.2f load=%.2f delay=%d "
+				"stop=%s\n", admitcfg.inflight, admitcfg.cpu, admitcfg.mem,
+				admitcfg.io, admitcfg.load, admitcfg.delay,
+				admitcfg.stop ? "on" : "off");
+}
+
+/* printstats - The stats builtin */
+	void 
+printstats(void)
+{
+	sample();
+	printf("admission: %lu admitted (%lu delayed), %lu held back, "
+			"%lu stopped, %lu resumed\n", admitstats.admitted,
+			admitstats.delayed, admitstats.held, admitstats.stopped,
+			admitstats.resumed);
+	printf("pressure:  cpu %.2f mem %.2f io %.2f load %.2f, "
+			"%d/%d jobs in flight\n", pressure.cpu, pressure.mem, pressure.io,
+			pressure.load, bgrunning(), admitcfg.inflight);
+	printf("timeouts:  %lu timed out, %lu needed SIGKILL, %d deadlines pending\n",
+			timeoutstats.timedout, timeoutstats.killed, wheel_count);
+	printf("appends:   %lu files opened, %lu cache hits, %lu reopened\n",
+			appendstats.opened, appendstats.hits, appendstats.reopened);
+	printf("heredocs:  %lu bodies, %lu reused, %lu piped, %lu opened from "
+			"%lu sealed memfds\n", heredocstats.bodies, heredocstats.hits,
+			heredocstats.piped, heredocstats.opened, heredocstats.sealed);
+	logsummary();
+	printf("scheduler: %d entries, %lu launched, %lu skipped, %lu queued, "
+			"jitter avg %.3fms max %.3fms\n", nsched, schedstats.launched,
+			schedstats.skipped, schedstats.queued,
+			schedstats.jn ? schedstats.jsum / 1e3 / schedstats.jn : 0,
+			schedstats.jmax / 1e3);
+}
+
+/*****************
+ * DAG executor
+ *****************/
+
+/*
+ * The dag builtin runs a graph file of lines
+ *
+ *     name: dep1 dep2 ... -> command
+ *
+ * (# starts a comment) with as much parallelism as the dependencies and
+ * the width (-j, at most MAXJOBS) allow.  Each node is an ordinary
+ * background job, launched only if admission control admits it.  The
+ * builtin sleeps in ppoll and learns from reaplog which nodes have
+ * finished, so a node is launched as soon as its last dependency has
+ * been reaped.  When a node fails, no new nodes are started, unless -k
+ * is given, in which case only the nodes that depend on it are skipped.
+ * At the end it prints a summary and the critical path through the
+ * graph.
+ */
+
+/* dagfind - Index of the node called name, -1 if there is none */
+	static int 
+dagfind(struct dagnode_t *nodes, int n, const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(nodes[i].name, name))
+			return i;
+	return -1;
+}
+
+/*
+ * dagload - Read a graph file into nodes.  Returns the number of nodes,
+ *     or -1 (after printing an error) if the file is malformed.
+ */
+	static int 
+dagload(const char *path, struct dagnode_t *nodes)
+{
+	FILE *fp;
+	char line[MAXLINE], *name, *deps, *cmd, *dep, *save;
+	static char depnames[MAXDAG][MAXDAGDEPS][DAGNAME];
+	int n = 0, i, j, lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		printf("dag: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, MAXLINE, fp) != NULL) {
+		lineno++;
+		line[strcspn(line, "#\n")] = '\0';
+		name = line + strspn(line, " \t");
+		if (*name == '\0')
+			continue;
+		if ((deps = strchr(name, ':')) == NULL ||
+				(cmd = strstr(deps, "->")) == NULL) {
+			printf("dag: %s:%d: expected name: deps -> command\n", path, lineno);
+			goto fail;
+		}
+		*deps++ = '\0';
+		*cmd = '\0';
+		cmd += 2 + strspn(cmd + 2, " \t");
+		name[strcspn(name, " \t")] = '\0';
+		if (n == MAXDAG || strlen(name) >= DAGNAME || *cmd == '\0' ||
+				dagfind(nodes, n, name) >= 0) {
+			printf("dag: %s:%d: bad or duplicate node %s\n", path, lineno, name);
+			goto fail;
+		}
+		memset(&nodes[n], 0, sizeof(nodes[n]));
+		strcpy(nodes[n].name, name);
+		if ((nodes[n].cmd = strdup(cmd)) == NULL)
+			goto fail;
+		for (dep = strtok_r(deps, " \t", &save); dep != NULL;
+				dep = strtok_r(NULL, " \t", &save)) {
+			if (nodes[n].ndeps == MAXDAGDEPS || strlen(dep) >= DAGNAME) {
+				printf("dag: %s:%d: too many dependencies\n", path, lineno);
+				n++;
+				goto fail;
+			}
+			strcpy(depnames[n][nodes[n].ndeps++], dep);
+		}
+		n++;
+	}
+	fclose(fp);
+
+	/* Resolve the dependencies now that all names are known */
+	for (i = 0; i < n; i++)
+		for (j = 0; j < nodes[i].ndeps; j++)
+			if ((nodes[i].deps[j] = dagfind(nodes, n, depnames[i][j])) < 0) {
+				printf("dag: %s: unknown dependency %s\n", nodes[i].name,
+						depnames[i][j]);
+				fp = NULL;
+				goto fail;
+			}
+	return n;
+
+fail:
+	if (fp != NULL)
+		fclose(fp);
+	for (i = 0; i < n; i++)
+		free(nodes[i].cmd);
+	return -1;
+}
+
+/* dagacyclic - Check with Kahn's algorithm that the graph has no cycle */
+	static int 
+dagacyclic(struct dagnode_t *nodes, int n)
+{
+	int indeg[MAXDAG], queue[MAXDAG], head = 0, tail = 0, i, j, k;
+
+	for (i = 0; i < n; i++)
+		if ((indeg[i] = nodes[i].ndeps) == 0)
+			queue[tail++] = i;
+	while (head < tail) {
+		k = queue[head++];
+		for (i = 0; i < n; i++)
+			for (j = 0; j < nodes[i].ndeps; j++)
+				if (nodes[i].deps[j] == k && --indeg[i] == 0)
+					queue[tail++] = i;
+	}
+	return tail == n;
+}
+
+/* dagskip - Skip every node that (transitively) depends on node k */
+	static void 
+dagskip(struct dagnode_t *nodes, int n, int k)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++)
+		for (j = 0; j < nodes[i].ndeps; j++)
+			if (nodes[i].deps[j] == k && nodes[i].state < D_RUN) {
+				nodes[i].state = D_SKIP;
+				dagskip(nodes, n, i);
+			}
+}
+
+/* daglaunch - Start node k as a background job; 0 on success */
+	static int 
+daglaunch(struct dagnode_t *node)
+{
+	struct cmdline_tokens tok;
+	int capfds[3] = { -1, -1, -1 };
+
+	if (parseline(node->cmd, &tok) != 0 || tok.argc == 0 ||
+			tok.builtins != BUILTIN_NONE) {
+		printf("dag: %s: not a command: %s\n", node->name, node->cmd);
+		return -1;
+	}
+	node->start = now_ms();
+	if ((capfds[1] = capfds[2] = capopen()) >= 0) {
+		node->pid = spawn(&tok, node->cmd, BG, capfds);
+		capattach(node->pid, capfds[1]);
+	} else
+		node->pid = spawn(&tok, node->cmd, BG, NULL);
+	if (tok.timeout || bgtimeout)
+		settimeout(node->pid, tok.timeout ? tok.timeout : bgtimeout);
+	if (verbose)
+		printf("dag: started %s [%d] (%d)\n", node->name, pid2jid(node->pid),
+				node->pid);
+	node->state = D_RUN;
+	return 0;
+}
+
+/* dagreport - Print the summary and the critical path */
+	static void 
+dagreport(struct dagnode_t *nodes, int n, long long t0)
+{
+	int path[MAXDAG], len = 0, i, j, k = -1, ok = 0, failed = 0, skipped = 0;
+	long long work = 0, wall = now_ms() - t0;
+
+	for (i = 0; i < n; i++) {
+		ok += nodes[i].state == D_OK;
+		failed += nodes[i].state == D_FAIL;
+		skipped += nodes[i].state != D_OK && nodes[i].state != D_FAIL;
+		if (nodes[i].state == D_OK || nodes[i].state == D_FAIL) {
+			work += nodes[i].end - nodes[i].start;
+			if (k < 0 || nodes[i].end > nodes[k].end)
+				k = i;
+		}
+	}
+	printf("dag: %d nodes, %d ok, %d failed, %d not run in %lld.%03llds "
+			"(work %lld.%03llds, parallelism %.2f)\n", n, ok, failed, skipped,
+			wall / 1000, wall % 1000, work / 1000, work % 1000,
+			wall ? (double) work / wall : 0.0);
+
+	/* Walk back from the last node to finish through the dependency
+	 * that finished last each time */
+	while (k >= 0) {
+		path[len++] = k;
+		for (i = -1, j = 0; j < nodes[k].ndeps; j++)
+			if (i < 0 || nodes[nodes[k].deps[j]].end > nodes[i].end)
+				i = nodes[k].deps[j];
+		k = i;
+	}
+	if (len == 0)
+		return;
+	printf("critical path (%lld.%03llds):\n", 
+			(nodes[path[0]].end - t0) / 1000, (nodes[path[0]].end - t0) % 1000);
+	while (len-- > 0) {
+		k = path[len];
+		printf("  %-20s start %6lld.%03llds  took %6lld.%03llds\n",
+				nodes[k].name, (nodes[k].start - t0) / 1000,
+				(nodes[k].start - t0) % 1000,
+				(nodes[k].end - nodes[k].start) / 1000,
+				(nodes[k].end - nodes[k].start) % 1000);
+	}
+}
+
+/*
+ * dagdone - Node k has ended with status exit (-1 if it is not known):
+ *     mark it and, if it failed, what depends on it.  Returns 1 if it
+ *     failed.
+ */
+	static int 
+dagdone(struct dagnode_t *nodes, int n, int k, int exit, int keepgoing,
+		int *stopping)
+{
+	struct dagnode_t *node = &nodes[k];
+
+	node->end = now_ms();
+	node->exit = exit;
+	if (exit == 0) {
+		node->state = D_OK;
+		return 0;
+	}
+	node->state = D_FAIL;
+	if (exit < 0)
+		printf("dag: %s failed (exit status lost)\n", node->name);
+	else
+		printf("dag: %s failed (exit %d)\n", node->name, exit);
+	if (keepgoing)
+		dagskip(nodes, n, k);
+	else
+		*stopping = 1;
+	return 1;
+}
+
+/*
+ * dagcmd - The dag builtin: dag [-j WIDTH] [-k] FILE.  Returns 0 if every
+ *     node succeeded, 1 otherwise.  When other jobs fill the job list it
+ *     waits for one of them to end, and a node admission control holds
+ *     back waits until it is admitted; ctrl-c stops it.
+ */
+	int 
+dagcmd(struct cmdline_tokens *tok)
+{
+	static struct dagnode_t nodes[MAXDAG];
+	struct dagnode_t *node;
+	sigset_t mask, masksuspend;
+	const char *path = NULL, *why;
+	unsigned seen;
+	int lost, n, i, j, width = MAXJOBS, keepgoing = 0, stopping = 0;
+	int running = 0, rc = 0, full, held;
+	long long t0;
+
+	for (i = 1; i < tok->argc; i++) {
+		if (!strcmp(tok->argv[i], "-k"))
+			keepgoing = 1;
+		else if (!strcmp(tok->argv[i], "-j") && i + 1 < tok->argc)
+			width = atoi(tok->argv[++i]);
+		else
+			path = tok->argv[i];
+	}
+	if (path == NULL || width < 1) {
+		printf("dag: usage: dag [-j WIDTH] [-k] FILE\n");
+		return 2;
+	}
+	if ((n = dagload(path, nodes)) < 0)
+		return 2;
+	if (!dagacyclic(nodes, n)) {
+		printf("dag: %s: dependency cycle\n", path);
+		for (i = 0; i < n; i++)
+			free(nodes[i].cmd);
+		return 2;
+	}
+
+	Sigfillset(&masksuspend);
+	Sigdelset(&masksuspend, SIGCHLD);
+	Sigdelset(&masksuspend, SIGINT);
+	Sigdelset(&masksuspend, SIGTSTP);
+	Sigdelset(&masksuspend, SIGIO);
+	Sigdelset(&masksuspend, SIGALRM);
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigaddset(&mask, SIGINT);
+	Sigaddset(&mask, SIGTSTP);
+	Sigaddset(&mask, SIGIO);
+	Sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	seen = reapcount;
+	dagactive = 1;
+	dagintr = 0;
+	dagtstp = 0;
+	t0 = now_ms();
+	while (1) {
+		/* Launch every ready node there is room for */
+		full = held = 0;
+		rebalance();
+		for (i = 0; i < n && !stopping; i++) {
+			node = &nodes[i];
+			if (node->state != D_WAIT || running >= width)
+				continue;
+			for (j = 0; j < node->ndeps; j++)
+				if (nodes[node->deps[j]].state != D_OK)
+					break;
+			if (j < node->ndeps)
+				continue;
+			if (!freejob()) {
+				full = 1;       /* wait for a job to end */
+				break;
+			}
+			if ((why = admitwhy()) != NULL) {
+				if (!node->held) {
+					printf("dag: %s held back: %s\n", node->name, why);
+					admitstats.held++;
+					node->held = 1;
+				}
+				held = 1;       /* retry when a job ends or pressure eases */
+				break;
+			}
+			admitstats.admitted++;
+			if (node->held)
+				admitstats.delayed++;
+			if (daglaunch(node) < 0) {
+				node->state = D_FAIL;
+				node->start = node->end = now_ms();
+				rc = 1;
+				if (keepgoing)
+					dagskip(nodes, n, i);
+				else
+					stopping = 1;
+				continue;
+			}
+			running++;
+		}
+		if (running == 0 && !full && !held)
+			break;
+
+		/* Pressure eases without a signal, so a held node is retried
+		 * every PSI_INTERVAL ms, as are throttled nodes */
+		if (ppoll(NULL, 0, held || admitstats.stopped > admitstats.resumed ?
+					&(struct timespec){ 0, PSI_INTERVAL * 1000000L } : NULL,
+					&masksuspend) < 0 && errno != EINTR)
+			unix_error("Ppoll error");
+		schedrun();
+
+		/* The nodes are background jobs and the dag itself has no process
+		 * to stop, so ctrl-z cannot suspend it and would only leave its
+		 * nodes to be waited for behind a prompt: say so and carry on */
+		if (dagtstp) {
+			dagtstp = 0;
+			printf("dag: ctrl-z ignored; ctrl-c stops the dag\n");
+		}
+
+		if (dagintr && !stopping) {
+			printf("dag: interrupted\n");
+			stopping = 1;
+			rc = 1;
+			for (i = 0; i < n; i++)
+				if (nodes[i].state == D_RUN)
+					kill(-nodes[i].pid, SIGINT);
+		}
+
+		/* Pick up the nodes that have been reaped.  If more children were
+		 * reaped than reaplog keeps, the ones that fell out of it are the
+		 * running nodes that have left the job list. */
+		lost = reapcount - seen > REAPLOG;
+		if (lost)
+			seen = reapcount - REAPLOG;
+		for (; seen != reapcount; seen++) {
+			struct reap_t *r = &reaplog[seen % REAPLOG];
+			if (WIFSTOPPED(r->status))
+				continue;
+			for (i = 0; i < n; i++)
+				if (nodes[i].state == D_RUN && nodes[i].pid == r->pid) {
+					running--;
+					rc |= dagdone(nodes, n, i, exitcode(r->status),
+							keepgoing, &stopping);
+					break;
+				}
+		}
+		for (i = 0; lost && i < n; i++)
+			if (nodes[i].state == D_RUN &&
+					getjobpid(job_list, nodes[i].pid) == NULL) {
+				running--;
+				rc |= dagdone(nodes, n, i, -1, keepgoing, &stopping);
+			}
+	}
+	dagactive = 0;
+
+	/* Nodes left waiting were not run: that is no success */
+	for (i = 0; i < n; i++)
+		if (nodes[i].state == D_WAIT)
+			rc = 1;
+	Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+	dagreport(nodes, n, t0);
+	for (i = 0; i < n; i++)
+		free(nodes[i].cmd);
+	return rc;
+}
+
+/*****************
+ * Scheduler
+ *****************/
+
+/*
+ * "every INTERVAL command" runs command as a background job every
+ * INTERVAL, and "at TIME command" runs it once, at a time of day
+ * (HH:MM[:SS], the next one to come) or after a duration.  Entries live
+ * in a binary min-heap ordered by when they are next due, so finding
+ * the next one is O(1) and rescheduling O(log n).
+ *
+ * Entries are launched only at safe points of the shell: while it
+ * waits for a command line (readcmd waits in ppoll until the next entry
+ * is due) and while it waits for a foreground job or a dag.  A POSIX
+ * timer armed for the earliest entry raises SIGALRM, which interrupts
+ * all of these waits.  The delay between when an entry was due and when
+ * its job was started is its jitter.
+ *
+ * When an entry falls due while its last run is still going, its
+ * policy decides: skip the run (the default), queue it until that run
+ * has finished (up to SCHEDQUEUE runs), or allow both to run at once.
+ * Runs missed because the shell was busy for a whole interval count as
+ * skipped.  Scheduled jobs use the stdin, stdout and stderr the shell
+ * had when the first entry was made, whatever the shell's own
+ * descriptors are redirected to when they are launched.
+ */
+
+/* sched_us - Monotonic clock in microseconds (the clock of schedtimer) */
+	static long long 
+sched_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* schedswap - Exchange two entries of the heap */
+	static void 
+schedswap(int i, int j)
+{
+	struct schedent_t *e = schedheap[i];
+
+	schedheap[i] = schedheap[j];
+	schedheap[j] = e;
+	schedheap[i]->slot = i;
+	schedheap[j]->slot = j;
+}
+
+/* schedsift - Move the entry at heap index i to where its due time belongs */
+	static void 
+schedsift(int i)
+{
+	int c;
+
+	while (i > 0 && schedheap[(i - 1) / 2]->due > schedheap[i]->due) {
+		schedswap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while ((c = 2 * i + 1) < nsched) {
+		if (c + 1 < nsched && schedheap[c + 1]->due < schedheap[c]->due)
+			c++;
+		if (schedheap[i]->due <= schedheap[c]->due)
+			break;
+		schedswap(i, c);
+		i = c;
+	}
+}
+
+/* schedremove - Take an entry out of the heap and free it */
+	static void 
+schedremove(struct schedent_t *e)
+{
+	int i = e->slot;
+
+	if (i != --nsched) {
+		schedheap[i] = schedheap[nsched];
+		schedheap[i]->slot = i;
+		schedsift(i);
+	}
+	for (i = 0; i < e->ndocs; i++)
+		e->docs[i]->refs--;
+	e->ndocs = 0;
+	e->id = 0;
+}
+
+/* schedarm - Arm schedtimer for the earliest entry, or disarm it */
+	static void 
+schedarm(void)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	long long due;
+
+	if (nsched > 0) {
+		due = schedheap[0]->due;
+		its.it_value.tv_sec = due / 1000000;
+		its.it_value.tv_nsec = due % 1000000 * 1000 + 1; /* never 0 */
+	}
+	timer_settime(schedtimer, TIMER_ABSTIME, &its, NULL);
+}
+
+/* schedbusy - Is the last run of an entry still going? */
+	static int 
+schedbusy(struct schedent_t *e)
+{
+	return e->pid != 0 && getjobpid(job_list, e->pid) != NULL;
+}
+
+/*
+ * schedlaunch - Start a run of an entry, due at due, as a background job
+ *     and count its jitter.  Returns 1 if it was started, 0 if it was
+ *     held back (job list full, not admitted, or no parse buffer free)
+ *     and -1 if the entry is not a command.
+ */
+	static int 
+schedlaunch(struct schedent_t *e, long long due)
+{
+	long long jitter;
+	struct cmdline_tokens tok;
+	struct heredoc_t *saved[MAXREDIRS];
+	sigset_t mask, oldmask;
+	int fds[3], nsaved = nlinedocs, savednext = nextdoc, bad;
+
+	/* It may be launched while a command line is being run, or parsed
+	 * inside a $(...), so like a substitution it is parsed one level
+	 * deeper, keeping that line's copy and its xarena words intact */
+	if (substdepth == MAXSUBST)
+		return 0;
+
+	/* Its here-documents get the bodies it kept, not those of a line
+	 * that may be being read */
+	memcpy(saved, linedocs, sizeof(saved));
+	memcpy(linedocs, e->docs, e->ndocs * sizeof(e->docs[0]));
+	nlinedocs = e->ndocs;
+	nextdoc = 0;
+	substdepth++;
+	bad = parseline(e->cmd, &tok) < 0 || tok.argc == 0 ||
+		tok.builtins != BUILTIN_NONE;
+	substdepth--;
+	memcpy(linedocs, saved, sizeof(saved));
+	nlinedocs = nsaved;
+	nextdoc = savednext;
+	if (bad) {
+		printf("sched %d: not a command: %s\n", e->id, e->cmd);
+		return -1;
+	}
+	if (!freejob() || !admit(0))
+		return 0;
+
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigaddset(&mask, SIGINT);
+	Sigaddset(&mask, SIGTSTP);
+	Sigaddset(&mask, SIGIO);
+	Sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	memcpy(fds, schedfds, sizeof(fds));
+	if ((fds[1] = fds[2] = capopen()) >= 0) {
+		e->pid = spawn(&tok, e->cmd, BG, fds);
+		capattach(e->pid, fds[1]);
+	} else {
+		memcpy(fds, schedfds, sizeof(fds));
+		e->pid = spawn(&tok, e->cmd, BG, fds);
+	}
+	if (tok.timeout || bgtimeout)
+		settimeout(e->pid, tok.timeout ? tok.timeout : bgtimeout);
+	Sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+	if (verbose)
+		printf("sched %d: started [%d] (%d) %s\n", e->id, pid2jid(e->pid),
+				e->pid, e->cmd);
+	e->runs++;
+	schedstats.launched++;
+	jitter = sched_us() - due;
+	e->jsum += jitter;
+	e->jn++;
+	schedstats.jsum += jitter;
+	schedstats.jn++;
+	if (jitter > e->jmax)
+		e->jmax = jitter;
+	if (jitter > schedstats.jmax)
+		schedstats.jmax = jitter;
+	return 1;
+}
+
+/* schedskip - Count n runs of an entry that did not happen */
+	static void 
+schedskip(struct schedent_t *e, long long n)
+{
+	e->skipped += n;
+	schedstats.skipped += n;
+}
+
+/* schedfire - The entry at the top of the heap is due */
+	static void 
+schedfire(struct schedent_t *e, long long now)
+{
+	long long missed;
+	int rc = 1;
+
+	if (schedbusy(e) && e->policy == SP_SKIP)
+		schedskip(e, 1);
+	else if (schedbusy(e) && e->policy == SP_QUEUE) {
+		if (e->queued < SCHEDQUEUE) {
+			e->qdue[(e->qhead + e->queued++) % SCHEDQUEUE] = e->due;
+			schedstats.queued++;
+		} else
+			schedskip(e, 1);
+	} else if ((rc = schedlaunch(e, e->due)) == 0)
+		schedskip(e, 1);
+
+	if (rc < 0 || e->period == 0) {
+		schedremove(e);
+		return;
+	}
+	e->due += e->period;
+	if (e->due <= now) {
+		/* The shell was busy for whole intervals */
+		missed = (now - e->due) / e->period + 1;
+		schedskip(e, missed);
+		e->due += missed * e->period;
+	}
+	schedsift(e->slot);
+}
+
+/*
+ * schedrun - Launch the entries that are due, and queued runs whose
+ *     previous run has finished.  Called at the shell's safe points.
+ */
+	void 
+schedrun(void)
+{
+	struct schedent_t *e;
+	long long now;
+	int i;
+
+	/* A forked copy of the shell runs none of them */
+	if (nsched == 0 || getpid() != schedpid)
+		return;
+	now = sched_us();
+	while (nsched > 0 && schedheap[0]->due <= now)
+		schedfire(schedheap[0], now);
+	for (i = 0; i < MAXSCHED; i++) {
+		e = &schedents[i];
+		/* A queued run's jitter counts from when it was due */
+		if (e->id != 0 && e->queued > 0 && !schedbusy(e) &&
+				schedlaunch(e, e->qdue[e->qhead]) > 0) {
+			e->qhead = (e->qhead + 1) % SCHEDQUEUE;
+			e->queued--;
+		}
+	}
+	schedarm();
+}
+
+/* schedwait - ms until the next entry is due, -1 if there is none */
+	int 
+schedwait(void)
+{
+	long long left;
+
+	if (nsched == 0 || getpid() != schedpid)
+		return -1;
+	left = schedheap[0]->due - sched_us();
+	if (left <= 0)
+		return 0;
+	return left > INT_MAX / 1000 ? INT_MAX : (left + 999) / 1000;
+}
+
+/*
+ * readcmd - Read a command line from cmdfd (stdin, or the script) into
+ *     cmdline, as fgets would, but with a newline after an unterminated
+ *     last line too.  While no whole line has been typed, due entries are
+ *     launched.  Returns 0 at end of file.
+ */
+	int 
+readcmd(char *cmdline)
+{
+	static char inbuf[4 * MAXLINE];
+	static size_t inlen;
+	static int eof;
+	struct pollfd pfd = { cmdfd, POLLIN, 0 };
+	struct timespec ts, *tp;
+	char *nl;
+	size_t len;
+	ssize_t n;
+	int ms;
+
+	while (1) {
+		nl = memchr(inbuf, '\n', inlen);
+		if (nl != NULL || inlen >= MAXLINE - 1) {
+			len = nl != NULL ? (size_t) (nl + 1 - inbuf) : MAXLINE - 1;
+			if (len > MAXLINE - 1)
+				len = MAXLINE - 1;
+			memcpy(cmdline, inbuf, len);
+			cmdline[len] = '\0';
+			memmove(inbuf, inbuf + len, inlen - len);
+			inlen -= len;
+			return 1;
+		}
+		if (eof && inlen > 0) {
+			memcpy(cmdline, inbuf, inlen);
+			strcpy(cmdline + inlen, "\n");
+			inlen = 0;
+			return 1;
+		}
+		if (eof)
+			return 0;
+
+		schedrun();
+		if ((ms = schedwait()) >= 0) {
+			ts.tv_sec = ms / 1000;
+			ts.tv_nsec = ms % 1000 * 1000000L;
+			tp = &ts;
+		} else
+			tp = NULL;
+		if (ppoll(&pfd, 1, tp, NULL) <= 0)
+			continue;           /* timed out or interrupted */
+		if ((n = read(cmdfd, inbuf + inlen, sizeof(inbuf) - inlen)) < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				app_error("read error");
+		} else if (n == 0)
+			eof = 1;
+		else
+			inlen += n;
+	}
+}
+
+/*
+ * schedclock - Parse the TIME of at: HH:MM[:SS] is the next such time of
+ *     day, anything else a duration (see parsetime).  Returns ms from
+ *     now, or -1.
+ */
+	static long 
+schedclock(const char *s)
+{
+	struct timespec now;
+	struct tm tm;
+	int h, m, sec = 0, n = 0;
+	time_t when;
+
+	if (strchr(s, ':') == NULL)
+		return parsetime(*s == '+' ? s + 1 : s);
+	if ((sscanf(s, "%d:%d%n:%d%n", &h, &m, &n, &sec, &n) < 2) ||
+			s[n] != '\0' || h < 0 || h > 23 || m < 0 || m > 59 ||
+			sec < 0 || sec > 59)
+		return -1;
+	clock_gettime(CLOCK_REALTIME, &now);
+	localtime_r(&now.tv_sec, &tm);
+	tm.tm_hour = h;
+	tm.tm_min = m;
+	tm.tm_sec = sec;
+	tm.tm_isdst = -1;
+	if ((when = mktime(&tm)) <= now.tv_sec) {
+		tm.tm_mday++;
+		tm.tm_isdst = -1;
+		when = mktime(&tm);
+	}
+	return (when - now.tv_sec) * 1000 - now.tv_nsec / 1000000;
+}
+
+/*
+ * schedcmd - The every and at builtins:
+ *
+ *     every [-p skip|queue|allow] INTERVAL command
+ *     at TIME command
+ *
+ *     The command is the rest of cmdline, as typed.
+ */
+	int 
+schedcmd(struct cmdline_tokens *tok, const char *cmdline)
+{
+	static int nextid;
+	struct sigevent sev;
+	struct schedent_t *e = NULL;
+	int at = tok->builtins == BUILTIN_AT, policy = SP_SKIP, i = 1, w;
+	const char *cmd = cmdline, *name = tok->argv[0];
+	long ms;
+	size_t len;
+
+	if (!at && tok->argc > 2 && !strcmp(tok->argv[1], "-p")) {
+		if (!strcmp(tok->argv[2], "skip"))
+			policy = SP_SKIP;
+		else if (!strcmp(tok->argv[2], "queue"))
+			policy = SP_QUEUE;
+		else if (!strcmp(tok->argv[2], "allow"))
+			policy = SP_ALLOW;
+		else
+			goto usage;
+		i = 3;
+	}
+	if (i + 1 >= tok->argc)
+		goto usage;
+	if ((ms = at ? schedclock(tok->argv[i]) : parsetime(tok->argv[i])) < 0 ||
+			(!at && ms == 0)) {
+		printf("%s: invalid %s %s\n", name, at ? "time" : "interval",
+				tok->argv[i]);
+		return 1;
+	}
+	if (listrunner || substdepth > 0) {
+		printf("%s: entries can only be made by the shell itself\n", name);
+		return 1;
+	}
+
+	/* Skip the words before the command */
+	for (w = 0; w <= i; w++) {
+		cmd += strspn(cmd, " \t");
+		cmd += strcspn(cmd, " \t");
+	}
+	cmd += strspn(cmd, " \t");
+
+	for (w = 0; w < MAXSCHED && e == NULL; w++)
+		if (schedents[w].id == 0)
+			e = &schedents[w];
+	if (e == NULL) {
+		printf("%s: too many entries\n", name);
+		return 1;
+	}
+
+	/* The first entry sets up the timer and the job's descriptors */
+	if (schedpid != getpid()) {
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_SIGNAL;
+		sev.sigev_signo = SIGALRM;
+		if (timer_create(CLOCK_MONOTONIC, &sev, &schedtimer) < 0) {
+			printf("%s: %s\n", name, strerror(errno));
+			return 1;
+		}
+		for (w = 0; w < 3; w++)
+			schedfds[w] = fcntl(w, F_DUPFD_CLOEXEC, 10);
+		schedpid = getpid();
+	}
+
+	memset(e, 0, sizeof(*e));
+	e->id = ++nextid;
+	strncpy(e->cmd, cmd, MAXLINE - 1);
+	/* Runs are background jobs anyway */
+	len = strlen(e->cmd);
+	while (len > 0 && strchr(" \t&", e->cmd[len - 1]) != NULL)
+		e->cmd[--len] = '\0';
+	/* Its here-documents keep their bodies for every run */
+	for (w = 0; w < tok->nredirs; w++)
+		if (tok->redirs[w].op == R_HEREDOC) {
+			e->docs[e->ndocs] = &heredocs[tok->redirs[w].tofd];
+			e->docs[e->ndocs++]->refs++;
+		}
+	e->policy = policy;
+	e->period = at ? 0 : ms * 1000LL;
+	e->due = sched_us() + ms * 1000LL;
+	e->slot = nsched;
+	schedheap[nsched++] = e;
+	schedsift(e->slot);
+	schedarm();
+	printf("sched %d: %s %s: %s\n", e->id, name, tok->argv[i], e->cmd);
+	return 0;
+
+usage:
+	if (at)
+		printf("at: usage: at TIME command\n");
+	else
+		printf("every: usage: every [-p skip|queue|allow] INTERVAL command\n");
+	return 2;
+}
+
+/*
+ * schedctl - The sched builtin: lists the entries with their runs and
+ *     jitter; "sched -c ID" cancels an entry and "sched -c all" all of
+ *     them.  Runs already started keep running.
+ */
+	int 
+schedctl(struct cmdline_tokens *tok)
+{
+	static const char *policies[] = { "skip", "queue", "allow" };
+	struct schedent_t *order[MAXSCHED], *e;
+	long long now = sched_us();
+	int i, j, n, id;
+
+	if (tok->argc == 3 && !strcmp(tok->argv[1], "-c")) {
+		id = !strcmp(tok->argv[2], "all") ? -1 : atoi(tok->argv[2]);
+		for (i = n = 0; i < MAXSCHED; i++) {
+			e = &schedents[i];
+			if (e->id != 0 && (id < 0 || e->id == id)) {
+				schedremove(e);
+				n++;
+			}
+		}
+		if (schedpid == getpid())
+			schedarm();
+		if (n == 0 && id >= 0) {
+			printf("sched: %s: no such entry\n", tok->argv[2]);
+			return 1;
+		}
+		return 0;
+	}
+	if (tok->argc != 1) {
+		printf("sched: usage: sched [-c ID|all]\n");
+		return 2;
+	}
+
+	memcpy(order, schedheap, nsched * sizeof(*order));
+	for (i = 1; i < nsched; i++)
+		for (j = i; j > 0 && order[j]->due < order[j-1]->due; j--) {
+			e = order[j];
+			order[j] = order[j-1];
+			order[j-1] = e;
+		}
+	for (i = 0; i < nsched; i++) {
+		e = order[i];
+		if (e->period)
+			printf("%d: every %.3fs (%s)", e->id, e->period / 1e6,
+					policies[e->policy]);
+		else
+			printf("%d: at", e->id);
+		printf(", next in %.3fs, %lu runs, %lu skipped", (e->due - now) / 1e6,
+				e->runs, e->skipped);
+		if (e->queued)
+			printf(", %d queued", e->queued);
+		if (e->jn)
+			printf(", jitter avg %.3fms max %.3fms",
+					e->jsum / 1e3 / e->jn, e->jmax / 1e3);
+		if (schedbusy(e))
+			printf(", running [%d]", pid2jid(e->pid));
+		printf(": %s\n", e->cmd);
+	}
+	return 0;
+}
+
+/*****************
+ * Session traces
+ *****************/
+
+/*
+ * With -r FILE the shell records its session for tshreplay: every
+ * command line read (and the here-document lines after it), every
+ * ctrl-c / ctrl-z it receives and the output of every jobs command,
+ * each line stamped with the milliseconds since the previous record:
+ *
+ *     #tshtrace 1
+ *     <ms> c <command line>
+ *     <ms> h <line of a here-document of the command line before>
+ *     <ms> s <signal number>
+ *     <ms> j <jid> <R|S|F> <command line>    (one per job after "jobs")
+ *
+ * PIDs are left out so that a replay can be compared with the recording.
+ * Records are written with a single write(2), since signal handlers add
+ * records too.
+ */
+
+/* traceopen - Start recording the session to path */
+	void 
+traceopen(const char *path)
+{
+	static const char header[] = "#tshtrace 1\n";
+
+	if ((tracefd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0)
+		unix_error("Trace open error");
+	if (write(tracefd, header, sizeof(header) - 1) < 0)
+		unix_error("Trace write error");
+	tracelast = now_ms();
+}
+
+/* tracerec - Append a record of the given type to the trace */
+	void 
+tracerec(char type, const char *text)
+{
+	char buf[MAXLINE + 32];
+	long long now;
+	int len, olderrno = errno;
+
+	if (tracefd < 0)
+		return;
+	now = now_ms();
+	len = snprintf(buf, sizeof(buf), "%lld %c %s\n", now - tracelast, type, text);
+	tracelast = now;
+	if (len >= (int) sizeof(buf))
+		len = sizeof(buf) - 1;
+	if (write(tracefd, buf, len) < 0)
+		fprintf(stderr, "Error writing to trace file\n");
+	errno = olderrno;
+}
+
+/* tracejobs - Record the job list as a jobs command would show it */
+	void 
+tracejobs(void)
+{
+	char buf[MAXLINE + 16];
+	int i;
+
+	for (i = 0; i < MAXJOBS; i++) {
+		if (job_list[i].pid == 0)
+			continue;
+		snprintf(buf, sizeof(buf), "%d %c %s", job_list[i].jid,
+				job_list[i].state == BG ? 'R' :
+				job_list[i].state == ST ? 'S' : 'F', job_list[i].cmdline);
+		tracerec('j', buf);
+	}
+}
+
+/*****************
+ * Job registry
+ *****************/
 
-	/* quit built-in command */
+/*
+ * With --shm NAME the job table is mirrored into a shared memory object
+ * laid out as in tsh_shm.h, for monitors such as tshtop.  shmpub is
+ * called wherever a job is added, removed or changes state.  It may run
+ * in a signal handler that interrupted another shmpub: the handler then
+ * only marks its slot dirty and the interrupted call writes it before
+ * returning, so a slot is never written by two shmpubs at once and the
+ * shell never has to block signals for the registry's sake.
+ */
 
-	if(tok.builtins == BUILTIN_QUIT)
-		/* Exit the shell if you get a quit command */
-		exit(0);
+/* shmclose - Remove the registry when the shell exits */
+	static void 
+shmclose(void)
+{
+	/* atexit handlers also run in forked copies of the shell */
+	if (shm != NULL && shm->shellpid == getpid())
+		shm_unlink(shmname);
+}
 
-	/* jobs built-in command */
-	if((tok.builtins)== BUILTIN_JOBS)
-	{
-		/* If the jobs output has to be redirected to another file, open two 
-		 * files fd3 and fdtemp and first point to the filetable pointed by 
-		 * STDOUT using fdtemp so that when we later reassign the STDOUT
-		 * file descriptor to point to the file table pointed by fd3 we still 
-		 * have not lost the original file table pointed to by STDOUT. Now since
-		 * STDOUT points to file table pointed by fd3, output is printed in that
-		 * file. After printing the output restore STDOUT using fdtemp and close
-		 * files.
-		 */
-		if(tok.outfile != NULL)
-		{
-			fd3=Open(tok.outfile,O_WRONLY,0);
-			fdtemp=Open(tok.outfile,O_WRONLY,0);
+/* shmopen - Create the registry called name */
+	void 
+shmopen(const char *name)
+{
+	int fd;
 
-			Dup2(STDOUT_FILENO,fdtemp);
-			Dup2(fd3,STDOUT_FILENO);
-			listjobs(job_list,STDOUT_FILENO);
-			Dup2(fdtemp,STDOUT_FILENO);
+	if ((fd = shm_open(name, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0)
+		unix_error("shm_open error");
+	if (ftruncate(fd, sizeof(struct tshshm_t)) < 0)
+		unix_error("ftruncate error");
+	shm = mmap(NULL, sizeof(struct tshshm_t), PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		unix_error("mmap error");
+	close(fd);
 
-			Close(fd3);
-			Close(fdtemp);
-		}
-		else
-			listjobs(job_list,STDOUT_FILENO);
-	}
+	shm->version = TSHSHM_VERSION;
+	shm->nslots = TSHSHM_SLOTS;
+	shm->slotsize = sizeof(struct tshshm_slot_t);
+	shm->shellpid = getpid();
+	__atomic_store_n(&shm->magic, TSHSHM_MAGIC, __ATOMIC_RELEASE);
+	shmname = name;
+	atexit(shmclose);
+}
 
-	if(tok.builtins== BUILTIN_NONE)
-	{
-		/* Delete only SIGCHLD, SIGINT and SIGTSTP from sigsuspend's mask so as
-		 * to ensure that it waits for only these three signals
-		 */
-		Sigfillset(&masksuspend);
-		Sigdelset(&masksuspend, SIGCHLD);
-		Sigdelset(&masksuspend, SIGINT);
-		Sigdelset(&masksuspend, SIGTSTP);
-
-		/* Now for the sigprocmask fill in only SIGCHLD, SIGINT and SIGTSTP so 
-		 * as to ensure that these three signals do not interrupt the parent 
-		 * until a job is added by blocking them till then , because otherwise 
-		 * these lead to race conditions
-		 */
-		Sigemptyset(&mask);
-		Sigaddset(&mask, SIGCHLD);
-		Sigaddset(&mask, SIGINT);
-		Sigaddset(&mask, SIGTSTP);
-		Sigprocmask(SIG_BLOCK,&mask,NULL);
-		if((pid=Fork())==0)
-		{
-			/* Set the group ID of the child to be equal to its PID and put it
-			 * in a different group than the parent tsh shell, so as to 
-			 * ensure that if it gets a sigint or sigtstp signal only the child 
-			 * is terminated or stopped and not the parent tsh shell
-			 */
-			Setpgid(0,0);
+/* shmwrite - Copy slot i of the job table into the registry */
+	static void 
+shmwrite(int i)
+{
+	struct tshshm_slot_t *s = &shm->slot[i];
+	struct job_t *job = &job_list[i];
 
-			/* Unblock SIGCHLD, SIGINT and SIGTSTP in the child */
-			Sigprocmask(SIG_UNBLOCK, &mask,NULL);
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	s->jid = job->jid;
+	s->pid = job->pid;
+	s->state = job->state;
+	s->flags = (job->throttled ? TSHSHM_THROTTLED : 0) |
+		(job->timedout ? TSHSHM_TIMEDOUT : 0) |
+		(job->owner >= 0 ? TSHSHM_REMOTE : 0);
+	s->started = job->started;
+	s->timeout = job->timeout;
+	strcpy(s->cmdline, job->cmdline);
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&shm->gen, 1, __ATOMIC_RELEASE);
+}
 
-			/* If input redirection redirect stdin to fd2 */
-			if(tok.infile != NULL)
-			{
-				fd2=Open(tok.infile,O_RDONLY,0);
-				Dup2(fd2,STDIN_FILENO);
-			}
+/* shmpub - Publish the current state of job to the registry */
+	void 
+shmpub(struct job_t *job)
+{
+	unsigned int dirty;
+	int i;
 
-			/* If output redirection redirect stdout to fd1 */
-			if(tok.outfile != NULL)
-			{
-				fd1=Open(tok.outfile,O_WRONLY|O_TRUNC,0);
-				Dup2(fd1,STDOUT_FILENO);
-			}
+	/* A background list's runner has a job table of its own */
+	if (shm == NULL || listrunner || job == NULL)
+		return;
+	__atomic_or_fetch(&shmdirty, 1u << (job - job_list), __ATOMIC_RELAXED);
+	if (shmbusy)
+		return;
+	do {
+		shmbusy = 1;
+		dirty = __atomic_exchange_n(&shmdirty, 0, __ATOMIC_RELAXED);
+		for (i = 0; i < MAXJOBS; i++)
+			if (dirty & (1u << i))
+				shmwrite(i);
+		shmbusy = 0;
+	} while (shmdirty);
+}
 
+/*****************
+ * Command daemon
+ *****************/
 
-			Execve(tok.argv[0],tok.argv,environ);
+/*
+ * With --serve the shell runs as a long-lived daemon that takes command
+ * lines from local clients over a SOCK_SEQPACKET socket (see
+ * tsh_serve.h for the wire format), so starting a command costs a round
+ * trip instead of a new shell process.  All clients share the job list.
+ * The loop keeps SIGCHLD, SIGINT and SIGTSTP blocked except while it
+ * sleeps in ppoll, so the handlers never run while it is using the job
+ * list, and sigchld_handler leaves the news for it in reaplog.
+ */
 
-		}
-		addjob(job_list,pid,state1,cmdline);
-		/* As seen below unblocking the signals is done only after addjob */
+/* dropclient - Disconnect client c; its jobs keep running */
+	static void 
+dropclient(int c)
+{
+	int i;
 
-		/* If the bg flag is not set, i.e. if its a foreground job wait for
-		 * it to execute using sigsuspend on the parent and making the parent 
-		 * wait until it gets a SIGCHLD when the foreground job terminates or it
-		 * gets a SIGINT or SIGTSTP signal
-		 */
-		if(!bg)
-		{
-			while(fgpid(job_list))
-				sigsuspend(&masksuspend);
-			Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	close(clients[c].fd);
+	clients[c].fd = -1;
+	for (i = 0; i < MAXJOBS; i++)
+		if (job_list[i].owner == c) {
+			job_list[i].owner = -1;
+			shmpub(&job_list[i]);
 		}
+	if (verbose)
+		printf("Client %d disconnected\n", c);
+}
 
-		/* If its a backgroud process print the details of the job and wait for
-		 * the users next command line input
-		 */
-		else
-		{
-			Sigprocmask(SIG_UNBLOCK, &mask, NULL);
-			printf("[%d] (%d) %s\n",pid2jid(pid),pid,cmdline);
-		}
+/* sendev - Send an event to client c, dropping the client if it lags */
+	static void 
+sendev(int c, uint32_t type, uint32_t tag, int jid, pid_t pid, int status,
+		const char *data, size_t len)
+{
+	union {
+		struct tshev_t ev;
+		char buf[TSH_MAXFRAME];
+	} frame;
 
+	if (c < 0 || clients[c].fd < 0)
 		return;
-	}
-
-
-	if (bg == -1) return;               /* parsing error */
-	if (tok.argv[0] == NULL)  return;   /* ignore empty lines */
+	if (len > TSH_MAXFRAME - sizeof(frame.ev))
+		len = TSH_MAXFRAME - sizeof(frame.ev);
+	frame.ev.magic = TSH_MAGIC;
+	frame.ev.type = type;
+	frame.ev.tag = tag;
+	frame.ev.jid = jid;
+	frame.ev.pid = pid;
+	frame.ev.status = status;
+	frame.ev.len = len;
+	if (len)
+		memcpy(frame.buf + sizeof(frame.ev), data, len);
+	if (send(clients[c].fd, frame.buf, sizeof(frame.ev) + len,
+				MSG_DONTWAIT|MSG_NOSIGNAL) < 0)
+		dropclient(c);
+}
 
-	return;
+/* senderr - Send an error event with a message */
+	static void 
+senderr(int c, uint32_t tag, const char *msg)
+{
+	sendev(c, TSHEV_ERROR, tag, 0, 0, 0, msg, strlen(msg));
 }
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Parameters:
- *   cmdline:  The command line, in the form:
- *
- *                command [arguments...] [< infile] [> oufile] [&]
- *
- *   tok:      Pointer to a cmdline_tokens structure. The elements of this
- *             structure will be populated with the parsed tokens. Characters 
- *             enclosed in single or double quotes are treated as a single
- *             argument. 
- * Returns:
- *   1:        if the user has requested a BG job
- *   0:        if the user has requested a FG job  
- *  -1:        if cmdline is incorrectly formatted
- * 
- * Note:       The string elements of tok (e.g., argv[], infile, outfile) 
- *             are statically allocated inside parseline() and will be 
- *             overwritten the next time this function is invoked.
+
+/*
+ * serve_run - Start the command line of a TSHREQ_RUN request as a
+ *     background job owned by client c.
  */
-	int 
-parseline(const char *cmdline, struct cmdline_tokens *tok) 
+	static void 
+serve_run(int c, struct tshreq_t *req, char *cmdline, int *fds)
 {
+	struct cmdline_tokens tok;
+	struct job_t *job;
+	char out[TSH_MAXFRAME];
+	int i, pfd[2], devnull = -1;
+	ssize_t n, len = 0;
+	pid_t pid;
 
-	static char array[MAXLINE];          /* holds local copy of command line */
-	const char delims[10] = " \t\r\n";   /* argument delimiters (white-space) */
-	char *buf = array;                   /* ptr that traverses command line */
-	char *next;                          /* ptr to the end of the current arg */
-	char *endbuf;                        /* ptr to the end of the 
-											cmdline string */
-	int is_bg;                           /* background job? */
+	if (parseline(cmdline, &tok) < 0 || tok.argc == 0) {
+		senderr(c, req->tag, "Malformed command line");
+		return;
+	}
+	if (tok.builtins == BUILTIN_JOBS) {
+		/* listjobs closes the descriptor it is given */
+		if (fds[1] >= 0) {
+			if ((i = dup(fds[1])) >= 0)
+				listjobs(job_list, i);
+			sendev(c, TSHEV_OUTPUT, req->tag, 0, 0, 0, NULL, 0);
+		} else if (pipe(pfd) == 0) {
+			listjobs(job_list, pfd[1]);
+			while ((n = read(pfd[0], out + len, sizeof(out) - len)) > 0)
+				len += n;
+			close(pfd[0]);
+			sendev(c, TSHEV_OUTPUT, req->tag, 0, 0, 0, out, len);
+		} else
+			senderr(c, req->tag, strerror(errno));
+		return;
+	}
+	if (tok.builtins != BUILTIN_NONE) {
+		senderr(c, req->tag, "Builtin not available in daemon mode");
+		return;
+	}
 
-	if (cmdline == NULL) {
-		(void) fprintf(stderr, "Error: command line is NULL\n");
-		return -1;
+	/* Make sure the job can be added before forking it */
+	if (!freejob()) {
+		senderr(c, req->tag, "Tried to create too many jobs");
+		return;
+	}
+	if (!admit(0)) {
+		senderr(c, req->tag, "Held back by admission control");
+		return;
 	}
 
-	(void) strncpy(buf, cmdline, MAXLINE);
-	endbuf = buf + strlen(buf);
+	if (fds[0] < 0)
+		fds[0] = devnull = open("/dev/null", O_RDONLY|O_CLOEXEC);
+	pid = spawn(&tok, cmdline, BG, fds);
+	if (tok.timeout || bgtimeout)
+		settimeout(pid, tok.timeout ? tok.timeout : bgtimeout);
+	if (devnull >= 0) {
+		close(devnull);
+		fds[0] = -1;
+	}
+	job = getjobpid(job_list, pid);
+	job->owner = c;
+	job->tag = req->tag;
+	shmpub(job);
+	sendev(c, TSHEV_STARTED, req->tag, job->jid, pid, 0, NULL, 0);
+}
 
-	tok->infile = NULL;
-	tok->outfile = NULL;
+/* serve_signal - Send a signal to a job for a TSHREQ_SIGNAL request */
+	static void 
+serve_signal(int c, struct tshreq_t *req)
+{
+	struct job_t *job;
 
-	/* Build the argv list */
-	parsing_state = ST_NORMAL;
-	tok->argc = 0;
+	if ((job = getjobjid(job_list, req->arg0)) == NULL) {
+		senderr(c, req->tag, "No such job");
+		return;
+	}
+	if (req->arg1 < 0 || req->arg1 >= NSIG || kill(-job->pid, req->arg1) < 0) {
+		senderr(c, req->tag, "Invalid signal");
+		return;
+	}
+	if (req->arg1 == SIGCONT && job->state == ST) {
+		job->state = BG;
+		shmpub(job);
+	}
+}
 
-	while (buf < endbuf) {
-		/* Skip the white-spaces */
-		buf += strspn (buf, delims);
-		if (buf >= endbuf) break;
-		/* Check for I/O redirection specifiers */
-		if (*buf == '<') {
-			if (tok->infile) {
-				(void) fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-				return -1;
-			}
-			parsing_state |= ST_INFILE;
-			buf++;
-			continue;
-		}
-		if (*buf == '>') {
-			if (tok->outfile) {
-				(void) fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-				return -1;
-			}
-			parsing_state |= ST_OUTFILE;
-			buf ++;
-			continue;
-		}
+/* serve_request - Read and carry out one request of client c */
+	static void 
+serve_request(int c)
+{
+	union {
+		struct tshreq_t req;
+		char buf[TSH_MAXFRAME + 1];
+	} frame;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	int fds[3] = { -1, -1, -1 }, nfds = 0, i, k, *fdp;
+	ssize_t n;
 
-		if (*buf == '\'' || *buf == '\"') {
-			/* Detect quoted tokens */
-			buf++;
-			next = strchr (buf, *(buf-1));
-		} else {
-			/* Find next delimiter */
-			next = buf + strcspn (buf, delims);
-		}
+	iov.iov_base = frame.buf;
+	iov.iov_len = TSH_MAXFRAME;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
 
-		if (next == NULL) {
-			/* Returned by strchr(); this means that the closing
-			   quote was not found. */
-			(void) fprintf (stderr, "Error: unmatched %c.\n", *(buf-1));
-			return -1;
+	if ((n = recvmsg(clients[c].fd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC)) <= 0) {
+		if (n == 0 || (errno != EAGAIN && errno != EINTR))
+			dropclient(c);
+		return;
+	}
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		fdp = (int *) CMSG_DATA(cm);
+		k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < k; i++) {
+			if (nfds < 3)
+				fds[nfds++] = fdp[i];
+			else
+				close(fdp[i]);
 		}
+	}
 
-		/* Terminate the token */
-		*next = '\0';
-
-		/* Record the token as either the next argument or the 
-		 * input/output file */
-		switch (parsing_state) {
-			case ST_NORMAL:
-				tok->argv[tok->argc++] = buf;
-				break;
-			case ST_INFILE:
-				tok->infile = buf;
+	if ((size_t) n < sizeof(frame.req) || frame.req.magic != TSH_MAGIC ||
+			frame.req.len != n - sizeof(frame.req) ||
+			(msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC))) {
+		senderr(c, (size_t) n < sizeof(frame.req) ? 0 : frame.req.tag,
+				"Malformed request");
+	} else {
+		frame.buf[n] = '\0';
+		switch (frame.req.type) {
+			case TSHREQ_RUN:
+				serve_run(c, &frame.req, frame.buf + sizeof(frame.req), fds);
 				break;
-			case ST_OUTFILE:
-				tok->outfile = buf;
+			case TSHREQ_SIGNAL:
+				serve_signal(c, &frame.req);
 				break;
 			default:
-				(void) fprintf(stderr, "Error: Ambiguous I/O redirection\n");
-				return -1;
+				senderr(c, frame.req.tag, "Unknown request type");
 		}
-		parsing_state = ST_NORMAL;
-
-		/* Check if argv is full */
-		if (tok->argc >= MAXARGS-1) break;
-
-		buf = next + 1;
 	}
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+}
 
-	if (parsing_state != ST_NORMAL) {
-		(void)fprintf(stderr,"Error: must provide file name for redirection\n");
-		return -1;
-	}
+/*
+ * serve - Run the command daemon on the Unix domain socket at path.
+ *     Never returns.
+ */
+	void 
+serve(const char *path)
+{
+	struct sockaddr_un addr;
+	struct pollfd pfd[MAXCLIENTS + 1];
+	int owner[MAXCLIENTS + 1];
+	struct reap_t *r;
+	sigset_t mask, waitmask;
+	unsigned seen = 0;
+	int lfd, fd, c, i, n;
 
-	/* The argument list must end with a NULL pointer */
-	tok->argv[tok->argc] = NULL;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		app_error("Socket path too long");
+	if ((lfd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK,
+					0)) < 0)
+		unix_error("Socket error");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		unix_error("Bind error");
+	if (listen(lfd, MAXCLIENTS) < 0)
+		unix_error("Listen error");
+	for (c = 0; c < MAXCLIENTS; c++)
+		clients[c].fd = -1;
 
-	if (tok->argc == 0)  /* ignore blank line */
-		return 1;
+	/* Signals are only taken while waiting in ppoll */
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigaddset(&mask, SIGINT);
+	Sigaddset(&mask, SIGTSTP);
+	Sigprocmask(SIG_BLOCK, &mask, &waitmask);
 
-	if (!strcmp(tok->argv[0], "quit")) {                 /* quit command */
-		tok->builtins = BUILTIN_QUIT;
-	} else if (!strcmp(tok->argv[0], "jobs")) {          /* jobs command */
-		tok->builtins = BUILTIN_JOBS;
-	} else if (!strcmp(tok->argv[0], "bg")) {            /* bg command */
-		tok->builtins = BUILTIN_BG;
-	} else if (!strcmp(tok->argv[0], "fg")) {            /* fg command */
-		tok->builtins = BUILTIN_FG;
-	} else {
-		tok->builtins = BUILTIN_NONE;
-	}
+	if (verbose)
+		printf("Serving on %s\n", path);
+	while (1) {
+		fflush(stdout);
+		n = 0;
+		pfd[n].fd = lfd;
+		pfd[n].events = POLLIN;
+		owner[n++] = -1;
+		for (c = 0; c < MAXCLIENTS; c++) {
+			if (clients[c].fd < 0)
+				continue;
+			pfd[n].fd = clients[c].fd;
+			pfd[n].events = POLLIN;
+			owner[n++] = c;
+		}
+		/* Wake up now and then to continue throttled jobs */
+		rebalance();
+		if (ppoll(pfd, n, admitstats.stopped > admitstats.resumed ?
+					&(struct timespec){ 1, 0 } : NULL, &waitmask) < 0) {
+			if (errno != EINTR)
+				unix_error("Ppoll error");
+			n = 0;
+		}
 
-	/* Should the job run in the background? */
-	if ((is_bg = (*tok->argv[tok->argc-1] == '&')) != 0)
-		tok->argv[--tok->argc] = NULL;
+		/* Tell clients about their jobs that stopped or terminated */
+		if (reapcount - seen > REAPLOG) {
+			printf("Lost %u job events\n", reapcount - seen - REAPLOG);
+			seen = reapcount - REAPLOG;
+		}
+		for (; seen != reapcount; seen++) {
+			r = &reaplog[seen % REAPLOG];
+			sendev(r->owner, WIFSTOPPED(r->status) ? TSHEV_STOPPED :
+					TSHEV_EXITED, r->tag, r->jid, r->pid, r->status, NULL, 0);
+		}
 
-	return is_bg;
-}
+		for (i = 1; i < n; i++)
+			if (pfd[i].revents && clients[owner[i]].fd >= 0)
+				serve_request(owner[i]);
 
+		if (n > 0 && (pfd[0].revents & POLLIN)) {
+			while ((fd = accept4(lfd, NULL, NULL,
+							SOCK_CLOEXEC|SOCK_NONBLOCK)) >= 0) {
+				for (c = 0; c < MAXCLIENTS && clients[c].fd >= 0; c++)
+					;
+				if (c == MAXCLIENTS) {
+					close(fd);
+					continue;
+				}
+				clients[c].fd = fd;
+				if (verbose)
+					printf("Client %d connected\n", c);
+			}
+		}
+	}
+}
 
 /*****************
  * Signal handlers
@@ -579,7 +6562,20 @@ sigchld_handler(int sig)
 		 * terminating because of an uncaught signal, and if this returns 
 		 * true the WTERMSIG is used to get the number of this signal.
 		 */
-		if((WIFSIGNALED(status)) && (WTERMSIG(status)))
+		a=getjobpid(job_list,pidchld);
+		/* Remember how the foreground job ended for command lists */
+		if(a && a->state==FG)
+		{
+			fgexit=(a->timedout && !WIFSTOPPED(status)) ? 124 :
+				exitcode(status);
+			fgintr=WIFSIGNALED(status) && WTERMSIG(status)==SIGINT;
+		}
+		if(a && a->timedout && !WIFSTOPPED(status))
+		{
+			printf("Job [%d] (%d) timed out after %ld.%03lds\n",
+					a->jid,pidchld,a->timeout/1000,a->timeout%1000);
+		}
+		else if((WIFSIGNALED(status)) && (WTERMSIG(status)))
 		{
 			printf("Job [%d] (%d) terminated by signal %d\n",
 					pid2jid(pidchld),pidchld,WTERMSIG(status));
@@ -591,15 +6587,22 @@ sigchld_handler(int sig)
 		else if((WIFSTOPPED(status)) && (WSTOPSIG(status)))
 		{	
 			chldjid=pid2jid(pidchld);
-			a=getjobpid(job_list,pidchld);
 			printf("Job [%d] (%d) stopped by signal %d\n",chldjid,pidchld,
 					WSTOPSIG(status));
-			a->state=ST;
-			return;
+			logreap(pidchld,status);
+			if(a)
+			{
+				a->state=ST;
+				shmpub(a);
+			}
+			continue;
 		}
 		/* deletejob is called whenever SIGCHLD is received due to child 
 		 * termination.
 		 */
+		logreap(pidchld,status);
+		capdone(pidchld);
+		untimeout(a);
 		deletejob(job_list,pidchld);
 	}
 	return;
@@ -616,13 +6619,16 @@ sigchld_handler(int sig)
 	void 
 sigint_handler(int sig) 
 {
+	tracerec('s', "2");
 	if((foreground=fgpid(job_list))>0)
 	{
 		Kill(-foreground,SIGINT);
 		return;
 	}
-	else
-		return;
+	/* The dag builtin runs its nodes in the background; let it know */
+	else if(dagactive)
+		dagintr=1;
+	return;
 }
 
 /*
@@ -636,19 +6642,79 @@ sigint_handler(int sig)
 	void 
 sigtstp_handler(int sig) 
 {
+	tracerec('s', "20");
 	if((foreground=fgpid(job_list))>0)
 	{
 		Kill(-foreground,SIGTSTP);
 		return;
 	}
-	else
-		return;
+	else if(dagactive)
+		dagtstp=1;
+	return;
+}
+
+/*
+ * sigio_handler - The kernel sends a SIGIO to the shell when output of a
+ *     captured background job is waiting in its pipe.
+ * Implementation: Every capture pipe that is still open is drained into
+ *     its ring buffer; the pipes are non-blocking so this never waits.
+ */
+	void 
+sigio_handler(int sig)
+{
+	int i, olderrno = errno;
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (captures[i].rfd >= 0 && captures[i].ring != NULL)
+			capdrain(&captures[i]);
+	errno = olderrno;
+}
+
+/*
+ * sigalrm_handler - The interval timer sends a SIGALRM every TICK_MS
+ *     while any job has a deadline.
+ * Implementation: the wheel is advanced tick by tick until it has caught
+ *     up with the clock, so late or merged signals lose no ticks.
+ *     SIGCHLD is held off so that sigchld_handler cannot cancel a
+ *     deadline while the wheel is being turned.
+ */
+	void 
+sigalrm_handler(int sig)
+{
+	sigset_t oldmask;
+	long long target = tick_now();
+	int olderrno = errno;
+
+	blockalrm(SIG_BLOCK, &oldmask);
+	while (wheel_count > 0 && wheel_now < target)
+		wheel_tick();
+	blockalrm(SIG_SETMASK, &oldmask);
+	errno = olderrno;
 }
 
 /*********************
  * End signal handlers
  *********************/
 
+/*
+ * logreap - Record a stopped or terminated child in reaplog, where the
+ *     daemon loop picks it up to notify the client owning the job.  Only
+ *     called from sigchld_handler, before the job is deleted.
+ */
+	void 
+logreap(pid_t pid, int status)
+{
+	struct job_t *job = getjobpid(job_list, pid);
+	struct reap_t *r = &reaplog[reapcount % REAPLOG];
+
+	r->pid = pid;
+	r->status = status;
+	r->jid = job ? job->jid : 0;
+	r->owner = job ? job->owner : -1;
+	r->tag = job ? job->tag : 0;
+	reapcount++;
+}
+
 /***********************************************
  * Helper routines that manipulate the job list
  **********************************************/
@@ -659,6 +6725,13 @@ clearjob(struct job_t *job) {
 	job->pid = 0;
 	job->jid = 0;
 	job->state = UNDEF;
+	job->owner = -1;
+	job->throttled = 0;
+	job->deadline = NULL;
+	job->timeout = 0;
+	job->timedout = 0;
+	job->tag = 0;
+	job->started = 0;
 	job->cmdline[0] = '\0';
 }
 
@@ -700,6 +6773,8 @@ addjob(struct job_t *job_list, pid_t pid, int state, char *cmdline)
 			if (nextjid > MAXJOBS)
 				nextjid = 1;
 			strcpy(job_list[i].cmdline, cmdline);
+			job_list[i].started = now_ms();
+			shmpub(&job_list[i]);
 			if(verbose){
 				printf("Added job [%d] %d %s\n", job_list[i].jid, job_list[i].pid, job_list[i].cmdline);
 			}
@@ -722,6 +6797,7 @@ deletejob(struct job_t *job_list, pid_t pid)
 	for (i = 0; i < MAXJOBS; i++) {
 		if (job_list[i].pid == pid) {
 			clearjob(&job_list[i]);
+			shmpub(&job_list[i]);
 			nextjid = maxjid(job_list)+1;
 			return 1;
 		}
@@ -729,6 +6805,18 @@ deletejob(struct job_t *job_list, pid_t pid)
 	return 0;
 }
 
+/* freejob - Return 1 if the job list has room for another job */
+	int 
+freejob(void)
+{
+	int i;
+
+	for (i = 0; i < MAXJOBS; i++)
+		if (job_list[i].pid == 0)
+			return 1;
+	return 0;
+}
+
 /* fgpid - Return PID of current foreground job, 0 if no such job */
 pid_t 
 fgpid(struct job_t *job_list) {
@@ -832,10 +6920,15 @@ listjobs(struct job_t *job_list, int output_fd)
 	void 
 usage(void) 
 {
-	printf("Usage: shell [-hvp]\n");
+	printf("Usage: shell [-hvp] [-g N] [-r FILE] [--serve PATH] [--shm NAME] [SCRIPT]\n");
 	printf("   -h   print this message\n");
 	printf("   -v   print additional diagnostic information\n");
 	printf("   -p   do not emit a command prompt\n");
+	printf("   -g N walk ** glob patterns with N threads\n");
+	printf("   -r FILE record the session to FILE for tshreplay\n");
+	printf("   --serve PATH  run commands for clients of socket PATH\n");
+	printf("   --shm NAME    mirror the job table into shared memory NAME\n");
+	printf("   SCRIPT        run the command lines of SCRIPT, without a prompt\n");
 	exit(1);
 }
 
@@ -1015,6 +7108,12 @@ int Dup2(int fd1, int fd2)
 void Execve(const char *filename, char *const argv[], char *const envp[])
 {
 	if(execve(filename, argv, envp)<0)
-		unix_error("Execve error");
+	{
+		/* Not unix_error: exit() in the child would move the offset of
+		 * the stdin it shares with the shell back over unread input */
+		fprintf(stdout, "Execve error: %s\n", strerror(errno));
+		fflush(stdout);
+		_exit(1);
+	}
 }
 
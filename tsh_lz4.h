@@ -0,0 +1,202 @@
+/*
+ * tsh_lz4.h - The LZ4 codec behind tsh's "> log:PREFIX" redirections
+ *
+ * A small, dependency-free implementation of the LZ4 block format and
+ * of just enough of the LZ4 frame format to write frames that the
+ * reference tools read (lz4 -dc, lz4cat):
+ *
+ *   frame  = magic 0x184D2204, FLG 0x60, BD 0x40, HC, blocks, 0 (u32)
+ *   block  = u32 size (bit 31 set if the data is stored uncompressed),
+ *            then size bytes
+ *
+ * FLG 0x60 is version 01 with independent blocks and no checksums, BD
+ * 0x40 a maximum block size of 64 KiB, HC the second byte of the XXH32
+ * of FLG and BD.  Every block decodes on its own, so a reader that
+ * knows where a block starts can decode it without the ones before.
+ *
+ * The compressor is greedy with a single hash probe per position: it
+ * trades some ratio for speed, which is what a log of text output
+ * wants.  The decompressor checks every length and offset, so a damaged
+ * block makes it fail instead of writing out of bounds.
+ */
+#ifndef TSH_LZ4_H
+#define TSH_LZ4_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define TSHLZ4_MAGIC     0x184D2204u
+#define TSHLZ4_BLOCK     (1<<16)      /* max bytes of input per block */
+#define TSHLZ4_HDRLEN    7            /* bytes of frame header */
+#define TSHLZ4_STORED    0x80000000u  /* block size flag: not compressed */
+#define TSHLZ4_HASHBITS  12
+
+/* Room a compressed block of n bytes may need */
+#define TSHLZ4_BOUND(n)  ((n) + (n) / 255 + 16)
+
+static inline uint32_t
+tshlz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline void
+tshlz4_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* tshlz4_putlen - Write the extra bytes of a length of 15 or more */
+static inline uint8_t *
+tshlz4_putlen(uint8_t *op, size_t len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/*
+ * tshlz4_compress - Compress n bytes (at most TSHLZ4_BLOCK) of src into
+ *     dst, which must hold TSHLZ4_BOUND(n) bytes.  Returns the size of
+ *     the compressed block.
+ */
+static inline size_t
+tshlz4_compress(const uint8_t *src, size_t n, uint8_t *dst)
+{
+	int32_t table[1 << TSHLZ4_HASHBITS];
+	const uint8_t *ip = src, *anchor = src, *end = src + n, *ref;
+	const uint8_t *mflimit = end - 12, *matchlimit = end - 5;
+	uint8_t *op = dst, *token;
+	size_t lit, len;
+	uint32_t h;
+
+	memset(table, 0xff, sizeof(table));
+	/* A match must start 12 bytes and end 5 bytes before the end */
+	while (n > 12 && ip < mflimit) {
+		h = (tshlz4_read32(ip) * 2654435761u) >> (32 - TSHLZ4_HASHBITS);
+		ref = table[h] < 0 ? NULL : src + table[h];
+		table[h] = ip - src;
+		if (ref == NULL || ip - ref > 65535 ||
+				tshlz4_read32(ref) != tshlz4_read32(ip)) {
+			ip++;
+			continue;
+		}
+		for (len = 4; ip + len < matchlimit && ip[len] == ref[len]; len++)
+			;
+
+		/* Literals since the last match, then the match */
+		lit = ip - anchor;
+		token = op++;
+		if (lit >= 15) {
+			*token = 15 << 4;
+			op = tshlz4_putlen(op, lit);
+		} else
+			*token = lit << 4;
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (len - 4 >= 15) {
+			*token |= 15;
+			op = tshlz4_putlen(op, len - 4);
+		} else
+			*token |= len - 4;
+		ip += len;
+		anchor = ip;
+	}
+
+	/* The rest goes out as literals */
+	lit = end - anchor;
+	if (lit >= 15) {
+		*op++ = 15 << 4;
+		op = tshlz4_putlen(op, lit);
+	} else
+		*op++ = lit << 4;
+	memcpy(op, anchor, lit);
+	return op + lit - dst;
+}
+
+/*
+ * tshlz4_decompress - Decode the n byte block src into dst, which has
+ *     room for cap bytes.  Returns the decoded size, or -1 if the block
+ *     is damaged or does not fit.
+ */
+static inline long
+tshlz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = src + n, *m;
+	uint8_t *op = dst, *oend = dst + cap;
+	size_t len, off;
+	unsigned b, token;
+
+	while (ip < iend) {
+		token = *ip++;
+		if ((len = token >> 4) == 15)
+			do {
+				if (ip >= iend)
+					return -1;
+				len += b = *ip++;
+			} while (b == 255);
+		if (len > (size_t) (iend - ip) || len > (size_t) (oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend)
+			break;                          /* the last sequence */
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > (size_t) (op - dst))
+			return -1;
+		if ((len = token & 15) == 15)
+			do {
+				if (ip >= iend)
+					return -1;
+				len += b = *ip++;
+			} while (b == 255);
+		len += 4;
+		if (len > (size_t) (oend - op))
+			return -1;
+		/* Byte by byte: the match may overlap what it produces */
+		for (m = op - off; len > 0; len--)
+			*op++ = *m++;
+	}
+	return op - dst;
+}
+
+/* tshlz4_header - Write the frame header to hdr (TSHLZ4_HDRLEN bytes) */
+static inline void
+tshlz4_header(uint8_t *hdr)
+{
+	const uint32_t p1 = 2654435761u, p2 = 2246822519u, p3 = 3266489917u;
+	const uint32_t p5 = 374761393u;
+	uint32_t h = p5 + 2;
+	int i;
+
+	tshlz4_le32(hdr, TSHLZ4_MAGIC);
+	hdr[4] = 0x60;
+	hdr[5] = 0x40;
+	/* XXH32 (seed 0) of the two descriptor bytes */
+	for (i = 4; i < 6; i++) {
+		h += hdr[i] * p5;
+		h = ((h << 11) | (h >> 21)) * p1;
+	}
+	h ^= h >> 15;
+	h *= p2;
+	h ^= h >> 13;
+	h *= p3;
+	h ^= h >> 16;
+	hdr[6] = h >> 8;
+}
+
+#endif /* TSH_LZ4_H */
@@ -0,0 +1,73 @@
+/*
+ * tsh_serve.h - Wire format of the tsh command daemon (tsh --serve PATH)
+ *
+ * The daemon listens on a SOCK_SEQPACKET Unix domain socket, so every
+ * send() is one frame and no length prefixing of the stream is needed.
+ *
+ * A client sends requests, each a struct tshreq_t followed by len bytes
+ * of payload:
+ *
+ *   TSHREQ_RUN     payload is a command line.  Up to three descriptors
+ *                  may be attached with SCM_RIGHTS; they become the
+ *                  job's stdin, stdout and stderr in that order (stdin
+ *                  defaults to /dev/null, the others to the daemon's).
+ *                  Commands always run as background jobs of the
+ *                  daemon.  "jobs" is answered in-process with a
+ *                  TSHEV_OUTPUT event, or written to the attached
+ *                  stdout if there is one.
+ *   TSHREQ_SIGNAL  arg0 is a job ID, arg1 a signal number.  The signal
+ *                  is sent to the job's process group; SIGCONT also
+ *                  moves a stopped job back to the running state.
+ *
+ * The daemon answers with events, each a struct tshev_t followed by
+ * len bytes of payload.  tag echoes the tag of the request an event
+ * belongs to:
+ *
+ *   TSHEV_STARTED  the job was added to the job table (jid, pid)
+ *   TSHEV_STOPPED  the job stopped; status is the wait(2) status
+ *   TSHEV_EXITED   the job terminated; status is the wait(2) status
+ *   TSHEV_OUTPUT   output of a builtin (payload)
+ *   TSHEV_ERROR    the request failed; payload is a message
+ *
+ * A client that does not read its events fast enough to keep the
+ * socket buffer from filling up is disconnected.  Jobs of a client that
+ * disconnects keep running in the daemon's job table.
+ */
+#ifndef TSH_SERVE_H
+#define TSH_SERVE_H
+
+#include <stdint.h>
+
+#define TSH_MAGIC     0x74736831u  /* "tsh1" */
+#define TSH_MAXFRAME 32768         /* max size of a frame, header included */
+
+/* Request types */
+#define TSHREQ_RUN        1
+#define TSHREQ_SIGNAL     2
+
+/* Event types */
+#define TSHEV_STARTED     1
+#define TSHEV_STOPPED     2
+#define TSHEV_EXITED      3
+#define TSHEV_OUTPUT      4
+#define TSHEV_ERROR       5
+
+struct tshreq_t {
+	uint32_t magic;         /* TSH_MAGIC */
+	uint32_t type;          /* TSHREQ_* */
+	uint32_t tag;           /* chosen by the client, echoed in events */
+	int32_t arg0, arg1;     /* request arguments */
+	uint32_t len;           /* bytes of payload that follow */
+};
+
+struct tshev_t {
+	uint32_t magic;         /* TSH_MAGIC */
+	uint32_t type;          /* TSHEV_* */
+	uint32_t tag;           /* tag of the request */
+	int32_t jid;            /* job ID, 0 if none */
+	int32_t pid;            /* process (group) ID, 0 if none */
+	int32_t status;         /* wait(2) status for STOPPED/EXITED */
+	uint32_t len;           /* bytes of payload that follow */
+};
+
+#endif /* TSH_SERVE_H */
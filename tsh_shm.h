@@ -0,0 +1,91 @@
+/*
+ * tsh_shm.h - Layout of the job registry of tsh --shm NAME
+ *
+ * With --shm NAME the shell mirrors its job table into the POSIX shared
+ * memory object NAME (shm_open(3), e.g. "/tsh-jobs"), which it creates
+ * at startup and unlinks when it exits.  The object holds one struct
+ * tshshm_t and never changes size.  Readers map it PROT_READ and never
+ * write to it; the shell never waits for them.
+ *
+ * Each slot mirrors one entry of the job table and is guarded by a
+ * sequence lock: the shell makes seq odd before it changes the slot and
+ * even again afterwards.  A reader copies the slot and keeps the copy
+ * only if seq was even and unchanged around the copy, retrying
+ * otherwise (tshshm_readslot does this).  gen is bumped after every slot
+ * update, so a reader that sees the same gen before and after reading
+ * all the slots holds a consistent snapshot of the whole table, and a
+ * reader that only wants to know whether anything changed can poll gen.
+ *
+ * Times are CLOCK_MONOTONIC milliseconds, comparable with the reader's
+ * own clock_gettime(CLOCK_MONOTONIC) on the same machine.
+ */
+#ifndef TSH_SHM_H
+#define TSH_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define TSHSHM_MAGIC   0x74736873u  /* "tshs" */
+#define TSHSHM_VERSION 1
+#define TSHSHM_SLOTS   16           /* MAXJOBS of the shell */
+#define TSHSHM_CMDLEN  1024         /* MAXLINE of the shell */
+
+/* Slot states, as in the shell's job table */
+#define TSHSHM_FREE    0            /* no job in this slot */
+#define TSHSHM_FG      1            /* running in the foreground */
+#define TSHSHM_BG      2            /* running in the background */
+#define TSHSHM_ST      3            /* stopped */
+
+/* Slot flags */
+#define TSHSHM_THROTTLED 0x1        /* stopped by admission control */
+#define TSHSHM_TIMEDOUT  0x2        /* ran past its time limit, being killed */
+#define TSHSHM_REMOTE    0x4        /* belongs to a connected daemon client */
+
+struct tshshm_slot_t {
+	uint32_t seq;           /* sequence lock, odd while being written */
+	int32_t jid;            /* job ID */
+	int32_t pid;            /* process (group) ID */
+	int32_t state;          /* TSHSHM_FREE, _FG, _BG or _ST */
+	uint32_t flags;         /* TSHSHM_THROTTLED, ... */
+	uint32_t pad;
+	int64_t started;        /* when the job was started (ms) */
+	int64_t timeout;        /* its time limit (ms), 0 if none */
+	char cmdline[TSHSHM_CMDLEN]; /* NUL-terminated command line */
+};
+
+struct tshshm_t {
+	uint32_t magic;         /* TSHSHM_MAGIC, written last at startup */
+	uint32_t version;       /* TSHSHM_VERSION */
+	uint32_t nslots;        /* TSHSHM_SLOTS */
+	uint32_t slotsize;      /* sizeof(struct tshshm_slot_t) */
+	int32_t shellpid;       /* the shell */
+	uint32_t gen;           /* bumped after every slot update */
+	struct tshshm_slot_t slot[TSHSHM_SLOTS];
+};
+
+/*
+ * tshshm_readslot - Copy slot i of shm into out without locking.
+ *     Returns 0, or -1 if the slot kept changing for tries attempts.
+ */
+static inline int
+tshshm_readslot(const struct tshshm_t *shm, int i, struct tshshm_slot_t *out,
+		int tries)
+{
+	const struct tshshm_slot_t *s = &shm->slot[i];
+	uint32_t seq;
+
+	while (tries-- > 0) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(out, s, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+			out->cmdline[TSHSHM_CMDLEN - 1] = '\0';
+			return 0;
+		}
+	}
+	return -1;
+}
+
+#endif /* TSH_SHM_H */
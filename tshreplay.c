@@ -0,0 +1,562 @@
+/*
+ * tshreplay - Replay recorded tsh sessions as a load generator
+ *
+ * usage: tshreplay [-hv] [-s shell] [-x speed] [-n N] [-t secs] trace...
+ *
+ * A trace is recorded with "tsh -r FILE" (see traces/ for examples).  For
+ * each trace, N copies of the shell are started side by side, each fed
+ * the recorded command lines (each with the here-document lines that
+ * followed it) over a pipe.  A command is sent once the shell has
+ * printed its prompt for the previous one and once its recorded time
+ * has come; -x 2 replays twice as fast as recorded and -x 0 sends
+ * commands as fast as the shell takes them.  Recorded ctrl-c and ctrl-z
+ * are sent to the shell with kill(2) at their recorded delay after the
+ * preceding record, unscaled by -x, so that they still land on the
+ * foreground job they were meant for.
+ *
+ * For every trace the tool reports commands per second over all shells,
+ * the prompt-to-prompt latency of commands (time from sending the line
+ * to the next prompt) and the number of "jobs" lines that differ from
+ * the recording, either in order, job ID, state or command line.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define MAXLINE      1024   /* max line size */
+#define MAXEVENTS (1<<16)  /* max records in a trace */
+#define MAXSHELLS     256   /* max concurrent shell instances */
+#define OUTBUF    (1<<16)  /* bytes of shell output kept per command */
+#define MAXSHOW         8   /* divergences printed with -v */
+
+/* A record of a trace */
+struct event_t {
+	char type;              /* 'c' command line, 's' signal */
+	long delay;             /* ms since the previous record */
+	char *text;             /* command line (and the lines of its
+	                           here-documents), or signal number */
+	char *expect;           /* for "jobs": recorded lines "jid S cmdline\n" */
+};
+
+/* Results of one trace, shared by the shells replaying it */
+struct result_t {
+	pthread_mutex_t lock;
+	long *lat;              /* prompt-to-prompt latencies (us) */
+	int nlat;
+	int diverged;           /* jobs lines that differ from the recording */
+	int shown;              /* divergences printed so far */
+	int failed;             /* shells that did not finish the trace */
+};
+
+struct trace_t {
+	const char *name;
+	struct event_t *ev;
+	int nev;
+	int ncmds;
+};
+
+struct shell_t {
+	struct trace_t *trace;
+	struct result_t *res;
+	int id;
+	pid_t pid;
+	int in, out;            /* pipes to the shell's stdin and from its stdout */
+	int prompts;            /* prompts seen so far */
+	char buf[OUTBUF];       /* output since the last command was sent */
+	int len;
+};
+
+/* Global variables */
+char *shell = "./tsh";      /* shell under test */
+double speed = 1;           /* replay rate; 0 means as fast as possible */
+int instances = 1;          /* concurrent shells per trace */
+int patience = 10;          /* secs to wait for a prompt */
+int verbose = 0;
+const char prompt[] = "tsh> ";
+
+/* Function prototypes */
+void loadtrace(struct trace_t *t, const char *path);
+void *replay(void *vargp);
+int startshell(struct shell_t *s);
+int waitprompt(struct shell_t *s, int want);
+void checkjobs(struct shell_t *s, struct event_t *e);
+void report(struct trace_t *t, struct result_t *res, double secs);
+long long now_us(void);
+void sleep_until(long long t);
+int cmplong(const void *a, const void *b);
+void usage(void);
+void unix_error(char *msg);
+void app_error(char *msg);
+
+	int
+main(int argc, char **argv)
+{
+	struct trace_t trace;
+	struct result_t res;
+	pthread_t tid[MAXSHELLS];
+	struct shell_t *shells;
+	long long start;
+	int c, i, t;
+
+	while ((c = getopt(argc, argv, "hvs:x:n:t:")) != EOF) {
+		switch (c) {
+			case 'h':
+				usage();
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 's':
+				shell = optarg;
+				break;
+			case 'x':
+				speed = atof(optarg);
+				if (speed < 0)
+					usage();
+				break;
+			case 'n':
+				instances = atoi(optarg);
+				if (instances < 1 || instances > MAXSHELLS)
+					usage();
+				break;
+			case 't':
+				patience = atoi(optarg);
+				if (patience < 1)
+					usage();
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	/* A shell that goes away must not take us with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((shells = calloc(instances, sizeof(struct shell_t))) == NULL)
+		unix_error("calloc error");
+
+	for (t = optind; t < argc; t++) {
+		loadtrace(&trace, argv[t]);
+		memset(&res, 0, sizeof(res));
+		pthread_mutex_init(&res.lock, NULL);
+		if ((res.lat = malloc(sizeof(long) * (trace.ncmds * instances + 1))) == NULL)
+			unix_error("malloc error");
+
+		start = now_us();
+		for (i = 0; i < instances; i++) {
+			shells[i].trace = &trace;
+			shells[i].res = &res;
+			shells[i].id = i;
+			if (pthread_create(&tid[i], NULL, replay, &shells[i]) != 0)
+				app_error("pthread_create error");
+		}
+		for (i = 0; i < instances; i++)
+			pthread_join(tid[i], NULL);
+		report(&trace, &res, (now_us() - start) / 1e6);
+
+		for (i = 0; i < trace.nev; i++) {
+			free(trace.ev[i].text);
+			free(trace.ev[i].expect);
+		}
+		free(trace.ev);
+		free(res.lat);
+		pthread_mutex_destroy(&res.lock);
+	}
+	free(shells);
+	exit(0);
+}
+
+/*
+ * loadtrace - Read a trace recorded by tsh -r
+ *
+ * The "j" records that follow a jobs command are attached to it as the
+ * output expected from the replay.
+ */
+	void
+loadtrace(struct trace_t *t, const char *path)
+{
+	char line[MAXLINE + 32], *text;
+	struct event_t *last = NULL;
+	long delay;
+	size_t n;
+	FILE *fp;
+	int lineno = 0;
+	char type;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, "#tshtrace 1", 11)) {
+		fprintf(stderr, "%s: not a tsh trace\n", path);
+		exit(1);
+	}
+	t->name = path;
+	t->nev = t->ncmds = 0;
+	if ((t->ev = calloc(MAXEVENTS, sizeof(struct event_t))) == NULL)
+		unix_error("calloc error");
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+		delay = strtol(line, &text, 10);
+		if (text == line || text[0] != ' ' || text[1] == '\0' || text[2] != ' ') {
+			fprintf(stderr, "%s:%d: bad record\n", path, lineno + 1);
+			exit(1);
+		}
+		type = text[1];
+		text += 3;
+
+		if (type == 'j') {
+			/* Expected jobs line, delay is always 0 */
+			if (last == NULL)
+				continue;
+			n = last->expect ? strlen(last->expect) : 0;
+			if ((last->expect = realloc(last->expect, n + strlen(text) + 2)) == NULL)
+				unix_error("realloc error");
+			sprintf(last->expect + n, "%s\n", text);
+			continue;
+		}
+		if (type == 'h') {
+			/* A line of a here-document, sent right after its command */
+			if (last == NULL || last->type != 'c') {
+				fprintf(stderr, "%s:%d: here-document line without a command\n",
+						path, lineno + 1);
+				exit(1);
+			}
+			n = strlen(last->text);
+			if ((last->text = realloc(last->text, n + strlen(text) + 2)) == NULL)
+				unix_error("realloc error");
+			sprintf(last->text + n, "\n%s", text);
+			continue;
+		}
+		if (type != 'c' && type != 's') {
+			fprintf(stderr, "%s:%d: unknown record type '%c'\n", path, lineno + 1, type);
+			exit(1);
+		}
+		if (t->nev == MAXEVENTS) {
+			fprintf(stderr, "%s: too many records\n", path);
+			exit(1);
+		}
+		last = &t->ev[t->nev++];
+		last->type = type;
+		last->delay = delay;
+		if ((last->text = strdup(text)) == NULL)
+			unix_error("strdup error");
+		if (type == 'c') {
+			t->ncmds++;
+			/* An empty listing is still something to compare against */
+			if (!strncmp(text, "jobs", 4) && (text[4] == '\0' || isspace((unsigned char) text[4])))
+				last->expect = strdup("");
+		}
+		else
+			last = NULL;
+	}
+	fclose(fp);
+}
+
+/*
+ * replay - Thread routine: run one shell through the trace
+ */
+	void *
+replay(void *vargp)
+{
+	struct shell_t *s = vargp;
+	struct trace_t *t = s->trace;
+	struct event_t *e;
+	long long due, sent;
+	int i, last = 0, sig, status, sentcmds = 0;
+
+	if (startshell(s) < 0 || waitprompt(s, 1) < 0) {
+		pthread_mutex_lock(&s->res->lock);
+		s->res->failed++;
+		pthread_mutex_unlock(&s->res->lock);
+		return NULL;
+	}
+
+	due = now_us();
+	sent = 0;
+	for (i = 0; i <= t->nev; i++) {
+		e = i < t->nev ? &t->ev[i] : NULL;
+		if (e != NULL && e->type == 's') {
+			/* Signals keep their recorded delay at any speed */
+			due += e->delay * 1000;
+			sleep_until(due);
+			sig = atoi(e->text);
+			if (kill(s->pid, sig) < 0)
+				break;
+			continue;
+		}
+
+		/* The previous command must have finished before we type this one */
+		if (waitprompt(s, sentcmds + 1) < 0)
+			break;
+		if (sent) {
+			pthread_mutex_lock(&s->res->lock);
+			s->res->lat[s->res->nlat++] = now_us() - sent;
+			pthread_mutex_unlock(&s->res->lock);
+			if (t->ev[last].expect != NULL)
+				checkjobs(s, &t->ev[last]);
+			sent = 0;
+		}
+		if (e == NULL)
+			break;
+		if (speed > 0) {
+			due += e->delay * 1000 / speed;
+			sleep_until(due);
+		}
+		else
+			due = now_us();
+
+		s->len = 0;
+		sent = now_us();
+		last = i;
+		if (dprintf(s->in, "%s\n", e->text) < 0)
+			break;
+		sentcmds++;
+	}
+
+	if (i < t->nev) {
+		fprintf(stderr, "shell %d: %s: gave up at record %d (%s)\n",
+				s->id, t->name, last + 1, t->ev[last].text);
+		pthread_mutex_lock(&s->res->lock);
+		s->res->failed++;
+		pthread_mutex_unlock(&s->res->lock);
+		kill(s->pid, SIGKILL);
+	}
+
+	/* End of input makes the shell quit */
+	close(s->in);
+	close(s->out);
+	while (waitpid(s->pid, &status, 0) < 0 && errno == EINTR)
+		;
+	return NULL;
+}
+
+/*
+ * startshell - Start a shell with its stdin and stdout on pipes
+ *
+ * stderr goes down the same pipe so that error messages show up in
+ * order with the rest of the output.
+ */
+	int
+startshell(struct shell_t *s)
+{
+	int in[2], out[2];
+
+	if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0) {
+		perror("pipe");
+		return -1;
+	}
+	if ((s->pid = fork()) < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (s->pid == 0) {
+		/* Keep the terminal's ctrl-c away from the shell */
+		setpgid(0, 0);
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(out[1], STDERR_FILENO);
+		execl(shell, shell, (char *) NULL);
+		fprintf(stderr, "%s: %s\n", shell, strerror(errno));
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	s->in = in[1];
+	s->out = out[0];
+	s->prompts = 0;
+	s->len = 0;
+	return 0;
+}
+
+/*
+ * waitprompt - Read shell output until want prompts have been printed
+ *
+ * Output read along the way is kept in s->buf for checkjobs.  Returns -1
+ * if the shell exits or stays silent for longer than the -t limit.
+ */
+	int
+waitprompt(struct shell_t *s, int want)
+{
+	struct pollfd pfd = { .fd = s->out, .events = POLLIN };
+	char chunk[4096];
+	char *p;
+	int n, i, from;
+
+	while (s->prompts < want) {
+		if ((n = poll(&pfd, 1, patience * 1000)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0 || (n = read(s->out, chunk, sizeof(chunk))) <= 0)
+			return -1;
+
+		/* Count prompts, including one split across two reads */
+		from = s->len > (int) sizeof(prompt) - 2 ? s->len - (int) sizeof(prompt) + 2 : 0;
+		for (i = 0; i < n; i++)
+			if (s->len < OUTBUF - 1)
+				s->buf[s->len++] = chunk[i];
+		s->buf[s->len] = '\0';
+		for (p = s->buf + from; (p = strstr(p, prompt)) != NULL; p += sizeof(prompt) - 1)
+			s->prompts++;
+	}
+	return 0;
+}
+
+/*
+ * checkjobs - Compare the output of a jobs command with the recording
+ *
+ * Lines look like "[jid] (pid) State cmdline"; the pid is dropped and the
+ * state shortened to its first letter, as in the trace.
+ */
+	void
+checkjobs(struct shell_t *s, struct event_t *e)
+{
+	char got[OUTBUF], *line, *next, *cmd;
+	char state[16];
+	int jid, pid, n, off = 0;
+	const char *want, *w, *g;
+
+	got[0] = '\0';
+	for (line = s->buf; line != NULL; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		while (!strncmp(line, prompt, sizeof(prompt) - 1))
+			line += sizeof(prompt) - 1;
+		if (sscanf(line, "[%d] (%d) %15s %n", &jid, &pid, state, &n) != 3)
+			continue;
+		if (strcmp(state, "Running") && strcmp(state, "Stopped") && strcmp(state, "Foreground"))
+			continue;
+		cmd = line + n;
+		off += snprintf(got + off, sizeof(got) - off, "%d %c %s\n", jid, state[0], cmd);
+		if (off >= (int) sizeof(got))
+			break;
+	}
+
+	/* Line by line, so that one missing job is not counted as many */
+	want = e->expect;
+	g = got;
+	while (*want || *g) {
+		w = strchr(want, '\n');
+		line = strchr(g, '\n');
+		n = (w && line && w - want == line - g && !strncmp(want, g, w - want));
+		if (!n) {
+			pthread_mutex_lock(&s->res->lock);
+			s->res->diverged++;
+			if (verbose && s->res->shown++ < MAXSHOW)
+				fprintf(stderr, "shell %d: jobs: expected \"%.*s\", got \"%.*s\"\n", s->id,
+						w ? (int) (w - want) : 0, want, line ? (int) (line - g) : 0, g);
+			pthread_mutex_unlock(&s->res->lock);
+		}
+		want = w ? w + 1 : want + strlen(want);
+		g = line ? line + 1 : g + strlen(g);
+	}
+}
+
+/*
+ * report - Print throughput, latency percentiles and divergences of a trace
+ */
+	void
+report(struct trace_t *t, struct result_t *res, double secs)
+{
+	long *lat = res->lat;
+	int n = res->nlat;
+
+	printf("%s: %d shell%s, %d commands in %.3fs, %.1f commands/s\n",
+			t->name, instances, instances == 1 ? "" : "s", n, secs,
+			secs > 0 ? n / secs : 0.0);
+	if (n > 0) {
+		qsort(lat, n, sizeof(long), cmplong);
+		printf("  latency: p50 %.3fms p90 %.3fms p99 %.3fms max %.3fms\n",
+				lat[n / 2] / 1e3, lat[n * 9 / 10] / 1e3,
+				lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+	}
+	printf("  jobs divergences: %d", res->diverged);
+	if (res->failed)
+		printf(", %d shell%s did not finish", res->failed, res->failed == 1 ? "" : "s");
+	printf("\n");
+}
+
+/* now_us - Monotonic clock in microseconds */
+	long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* sleep_until - Sleep until the monotonic clock reaches t (us) */
+	void
+sleep_until(long long t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000;
+	ts.tv_nsec = (t % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+	int
+cmplong(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * usage - print a help message
+ */
+	void
+usage(void)
+{
+	printf("Usage: tshreplay [-hv] [-s shell] [-x speed] [-n N] [-t secs] trace...\n");
+	printf("   -h        print this message\n");
+	printf("   -v        print the first few jobs divergences\n");
+	printf("   -s shell  shell to replay against (default ./tsh)\n");
+	printf("   -x speed  replay rate, 0 for as fast as possible (default 1)\n");
+	printf("   -n N      run N shells at once per trace (default 1)\n");
+	printf("   -t secs   give up on a shell silent for secs (default 10)\n");
+	exit(1);
+}
+
+/*
+ * unix_error - unix-style error routine
+ */
+	void
+unix_error(char *msg)
+{
+	fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+	exit(1);
+}
+
+/*
+ * app_error - application-style error routine
+ */
+	void
+app_error(char *msg)
+{
+	fprintf(stdout, "%s\n", msg);
+	exit(1);
+}
@@ -0,0 +1,198 @@
+/*
+ * tshtop - Watch the jobs of a tsh started with --shm NAME
+ *
+ * usage: tshtop [-h1] [-d ms] NAME
+ *
+ * Maps the shell's job registry (see tsh_shm.h) read-only and prints
+ * its jobs every -d ms (1000 by default), or once with -1.  Reading the
+ * registry takes no locks and no system calls: slots are copied under
+ * their sequence locks and the table is read again if the shell changed
+ * it while we were reading, so every listing is a consistent snapshot.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tsh_shm.h"
+
+#define SLOTTRIES   1000   /* attempts at reading a busy slot */
+#define SNAPTRIES    100   /* attempts at a consistent table */
+
+/* Global variables */
+long delay = 1000;          /* ms between listings */
+int once = 0;               /* print one listing and exit */
+
+/* Function prototypes */
+int snapshot(const struct tshshm_t *shm, struct tshshm_slot_t *slots);
+void show(const struct tshshm_t *shm, struct tshshm_slot_t *slots, int tty);
+long long now_ms(void);
+void usage(void);
+void unix_error(char *msg);
+
+	int
+main(int argc, char **argv)
+{
+	struct tshshm_slot_t slots[TSHSHM_SLOTS];
+	const struct tshshm_t *shm;
+	struct timespec ts;
+	int c, fd, tty;
+
+	while ((c = getopt(argc, argv, "h1d:")) != EOF) {
+		switch (c) {
+			case '1':
+				once = 1;
+				break;
+			case 'd':
+				if ((delay = atol(optarg)) <= 0)
+					usage();
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	if ((fd = shm_open(argv[optind], O_RDONLY, 0)) < 0)
+		unix_error(argv[optind]);
+	shm = mmap(NULL, sizeof(struct tshshm_t), PROT_READ, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		unix_error("mmap error");
+	close(fd);
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != TSHSHM_MAGIC ||
+			shm->version != TSHSHM_VERSION || shm->nslots != TSHSHM_SLOTS ||
+			shm->slotsize != sizeof(struct tshshm_slot_t)) {
+		fprintf(stderr, "%s: not a tsh job registry (or another version)\n",
+				argv[optind]);
+		exit(1);
+	}
+
+	tty = !once && isatty(STDOUT_FILENO);
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000;
+	while (1) {
+		if (snapshot(shm, slots) < 0)
+			fprintf(stderr, "tshtop: the job table is changing too fast\n");
+		else
+			show(shm, slots, tty);
+		if (once)
+			break;
+		/* Stop when the shell is gone */
+		if (kill(shm->shellpid, 0) < 0 && errno == ESRCH) {
+			printf("tshtop: shell %d has exited\n", shm->shellpid);
+			break;
+		}
+		nanosleep(&ts, NULL);
+	}
+	exit(0);
+}
+
+/*
+ * snapshot - Copy all slots of the registry, consistently with each
+ *     other.  Returns -1 if the shell never held still long enough.
+ */
+	int
+snapshot(const struct tshshm_t *shm, struct tshshm_slot_t *slots)
+{
+	uint32_t gen;
+	int i, tries;
+
+	for (tries = 0; tries < SNAPTRIES; tries++) {
+		gen = __atomic_load_n(&shm->gen, __ATOMIC_ACQUIRE);
+		for (i = 0; i < TSHSHM_SLOTS; i++)
+			if (tshshm_readslot(shm, i, &slots[i], SLOTTRIES) < 0)
+				break;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (i == TSHSHM_SLOTS && __atomic_load_n(&shm->gen, __ATOMIC_RELAXED) == gen)
+			return 0;
+	}
+	return -1;
+}
+
+/*
+ * show - Print a listing of the jobs in slots, in job ID order
+ */
+	void
+show(const struct tshshm_t *shm, struct tshshm_slot_t *slots, int tty)
+{
+	static const char *states[] = { "Free", "Foreground", "Running", "Stopped" };
+	struct tshshm_slot_t *order[TSHSHM_SLOTS], *t;
+	long long now = now_ms(), age;
+	char flags[4];
+	int i, j, n = 0;
+
+	for (i = 0; i < TSHSHM_SLOTS; i++)
+		if (slots[i].state != TSHSHM_FREE && slots[i].pid != 0)
+			order[n++] = &slots[i];
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && order[j]->jid < order[j-1]->jid; j--) {
+			t = order[j];
+			order[j] = order[j-1];
+			order[j-1] = t;
+		}
+
+	if (tty)
+		printf("\033[H\033[2J");
+	printf("tsh %d: %d job%s, generation %u\n", shm->shellpid, n,
+			n == 1 ? "" : "s", shm->gen);
+	printf("%5s %7s %-10s %5s %9s %9s  %s\n",
+			"JID", "PID", "STATE", "FLAGS", "AGE", "LIMIT", "COMMAND");
+	for (i = 0; i < n; i++) {
+		t = order[i];
+		age = now - t->started;
+		flags[0] = t->flags & TSHSHM_THROTTLED ? 'T' : '-';
+		flags[1] = t->flags & TSHSHM_TIMEDOUT ? 'K' : '-';
+		flags[2] = t->flags & TSHSHM_REMOTE ? 'R' : '-';
+		flags[3] = '\0';
+		printf("%5d %7d %-10s %5s %8.1fs ", t->jid, t->pid,
+				t->state >= 0 && t->state <= TSHSHM_ST ? states[t->state] : "?",
+				flags, age / 1e3);
+		if (t->timeout)
+			printf("%8.1fs ", t->timeout / 1e3);
+		else
+			printf("%9s ", "-");
+		printf(" %s\n", t->cmdline);
+	}
+	fflush(stdout);
+}
+
+/* now_ms - Monotonic clock in milliseconds */
+	long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * usage - print a help message
+ */
+	void
+usage(void)
+{
+	printf("Usage: tshtop [-h1] [-d ms] NAME\n");
+	printf("   -h     print this message\n");
+	printf("   -1     print the jobs once and exit\n");
+	printf("   -d ms  time between listings (default 1000)\n");
+	printf("Flags: T throttled, K timed out, R belongs to a daemon client\n");
+	exit(1);
+}
+
+/*
+ * unix_error - unix-style error routine
+ */
+	void
+unix_error(char *msg)
+{
+	fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+	exit(1);
+}